@@ -0,0 +1,80 @@
+#include "dutycycle.hpp"
+#include "utils/time.hpp"
+
+const LoRaSubBand_t LORA_SUBBANDS_EU868[LORA_SUBBANDS_EU868_COUNT] = {
+    { 863000000, 865000000,   10 },  // 0.1%
+    { 865000000, 868000000,  100 },  // 1%
+    { 868000000, 868600000,  100 },  // 1%   (g1)
+    { 868700000, 869200000,   10 },  // 0.1% (g2)
+    { 869400000, 869650000, 1000 },  // 10%  (g3)
+    { 869700000, 870000000,  100 },  // 1%   (g4)
+};
+
+void LoRaDutyCycle::setSubBands(const LoRaSubBand_t* subBands, uint8_t count) {
+    m_subBands = subBands;
+    m_subBandsCount = (subBands == NULL) ? 0 : ((count > LORA_DUTYCYCLE_SUBBANDS_MAX) ? LORA_DUTYCYCLE_SUBBANDS_MAX : count);
+
+    uint64_t currMillis = getMillis();
+    for (int i=0; i<m_subBandsCount; ++i) {
+        m_buckets[i].tokens = _capacity(i);
+        m_buckets[i].refilledAt = currMillis;
+    }
+}
+
+uint32_t LoRaDutyCycle::getWaitTime(uint32_t frequency, uint32_t airtime) {
+    int idx = _findSubBand(frequency);
+    if (idx < 0) return 0;
+    if (airtime > _capacity(idx)) return LORA_DUTYCYCLE_NEVER;
+
+    _refill(idx);
+    LoRaTokenBucket_t* bucket = &m_buckets[idx];
+    if (bucket->tokens >= airtime) return 0;
+
+    // Time for the missing airtime to be earned at the sub-band duty cycle, rounded up
+    uint64_t missing = airtime - bucket->tokens;
+    uint64_t waitMicros = (missing * LORA_DUTYCYCLE_UNLIMITED + m_subBands[idx].dutyCycle - 1) / m_subBands[idx].dutyCycle;
+    return (waitMicros + 999) / 1000;
+}
+
+void LoRaDutyCycle::consume(uint32_t frequency, uint32_t airtime) {
+    int idx = _findSubBand(frequency);
+    if (idx < 0) return;
+
+    _refill(idx);
+    LoRaTokenBucket_t* bucket = &m_buckets[idx];
+    bucket->tokens = (bucket->tokens > airtime) ? (bucket->tokens - airtime) : 0;
+}
+
+uint64_t LoRaDutyCycle::getAvailable(uint32_t frequency) {
+    int idx = _findSubBand(frequency);
+    if (idx < 0) return UINT64_MAX;
+
+    _refill(idx);
+    return m_buckets[idx].tokens;
+}
+
+
+int LoRaDutyCycle::_findSubBand(uint32_t frequency) {
+    for (int i=0; i<m_subBandsCount; ++i) {
+        if (frequency >= m_subBands[i].frequencyMin && frequency <= m_subBands[i].frequencyMax) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void LoRaDutyCycle::_refill(int idx) {
+    LoRaTokenBucket_t* bucket = &m_buckets[idx];
+    uint64_t currMillis = getMillis();
+    uint64_t elapsed = currMillis - bucket->refilledAt;
+    uint64_t earned = (elapsed * 1000 * m_subBands[idx].dutyCycle) / LORA_DUTYCYCLE_UNLIMITED;
+    if (earned == 0) return;    // keep accumulating elapsed time, otherwise frequent calls would never earn anything
+    bucket->refilledAt = currMillis;
+
+    uint64_t capacity = _capacity(idx);
+    bucket->tokens = (bucket->tokens + earned > capacity) ? capacity : (bucket->tokens + earned);
+}
+
+uint64_t LoRaDutyCycle::_capacity(int idx) {
+    return ((uint64_t)LORA_DUTYCYCLE_WINDOW * 1000 * m_subBands[idx].dutyCycle) / LORA_DUTYCYCLE_UNLIMITED;
+}
@@ -0,0 +1,104 @@
+/**
+* @file     dutycycle.hpp
+* @brief    LoRa airtime budget per frequency sub-band.
+* @author   PiniponSelvagem
+*
+* Copyright(C) PiniponSelvagem
+*
+***********************************************************************
+* Software that is described here, is for illustrative purposes only
+* which provides customers with programming information regarding the
+* products. This software is supplied "AS IS" without any warranties.
+**********************************************************************/
+
+#pragma once
+
+#ifndef _PINICORE_LORA_DUTYCYCLE_H_
+#define _PINICORE_LORA_DUTYCYCLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LORA_DUTYCYCLE_SUBBANDS_MAX 8           // Maximum number of sub-bands that can be configured.
+#define LORA_DUTYCYCLE_WINDOW       3600000     // Observation window in millis over which the duty cycle is enforced, ETSI uses 1 hour.
+#define LORA_DUTYCYCLE_UNLIMITED    10000       // Duty cycle value for 100%.
+#define LORA_DUTYCYCLE_NEVER        UINT32_MAX  // Returned by \ref 'LoRaDutyCycle::getWaitTime' when the airtime does not fit in the sub-band budget.
+
+typedef struct {
+    uint32_t frequencyMin;  // Lowest frequency of the sub-band in Hz, inclusive.
+    uint32_t frequencyMax;  // Highest frequency of the sub-band in Hz, inclusive.
+    uint16_t dutyCycle;     // Allowed duty cycle in 0.01% units, 100 = 1%.
+} LoRaSubBand_t;
+
+/**
+ * @brief   ETSI EN 300 220 sub-bands for Europe 863-870MHz.
+ */
+#define LORA_SUBBANDS_EU868_COUNT 6
+extern const LoRaSubBand_t LORA_SUBBANDS_EU868[LORA_SUBBANDS_EU868_COUNT];
+
+typedef struct {
+    uint64_t tokens;        // Airtime available in micros.
+    uint64_t refilledAt;    // Last time the tokens were refilled, in millis.
+} LoRaTokenBucket_t;
+
+class LoRaDutyCycle {
+    public:
+        /**
+         * @brief   Configure the sub-bands and their duty cycle, the budget of each one starts full.
+         * @param   subBands Array of sub-bands, must stay valid while in use. NULL disables the duty cycle enforcement.
+         * @param   count Number of sub-bands in the array, up to \ref 'LORA_DUTYCYCLE_SUBBANDS_MAX', the rest is ignored.
+         * @note    Frequencies outside of all the configured sub-bands are not limited.
+         */
+        void setSubBands(const LoRaSubBand_t* subBands, uint8_t count);
+
+        /**
+         * @brief   Get how long until a transmission fits the budget of its sub-band.
+         * @param   frequency Carrier frequency in Hz.
+         * @param   airtime Time on air of the transmission in micros.
+         * @return  Time in millis to wait, 0 if can be sent now, \ref 'LORA_DUTYCYCLE_NEVER' if larger than the sub-band budget.
+         */
+        uint32_t getWaitTime(uint32_t frequency, uint32_t airtime);
+
+        /**
+         * @brief   Take a transmission from the budget of its sub-band.
+         * @param   frequency Carrier frequency in Hz.
+         * @param   airtime Time on air of the transmission in micros.
+         */
+        void consume(uint32_t frequency, uint32_t airtime);
+
+        /**
+         * @brief   Get the airtime still available in the sub-band.
+         * @param   frequency Carrier frequency in Hz.
+         * @return  Airtime in micros, UINT64_MAX if the frequency is not limited.
+         */
+        uint64_t getAvailable(uint32_t frequency);
+
+
+    private:
+        /**
+         * @brief   Find the sub-band that contains the frequency.
+         * @param   frequency Carrier frequency in Hz.
+         * @return  Index in \ref 'm_subBands', -1 if not limited.
+         */
+        int _findSubBand(uint32_t frequency);
+
+        /**
+         * @brief   Add to the bucket the airtime earned since the last refill, up to its capacity.
+         * @param   idx Index of the sub-band.
+         */
+        void _refill(int idx);
+
+        /**
+         * @brief   Maximum airtime a sub-band bucket can hold.
+         * @param   idx Index of the sub-band.
+         * @return  Airtime in micros.
+         */
+        uint64_t _capacity(int idx);
+
+
+        const LoRaSubBand_t* m_subBands = NULL;
+        uint8_t m_subBandsCount = 0;
+        LoRaTokenBucket_t m_buckets[LORA_DUTYCYCLE_SUBBANDS_MAX] = {};
+};
+
+#endif // _PINICORE_LORA_DUTYCYCLE_H_
@@ -1,231 +1,1798 @@
 #include "loracomm.hpp"
 #include "utils/crypto.hpp"
+#include "utils/compress.hpp"
 #include "utils/log.hpp"
 #include <string.h>
+#include <stddef.h>
+#include <Arduino.h>
 
 #define PINICORE_TAG_LORACOMM    "pcore_loracomm"
 #define PINICORE_TAG_LORACOMM_CB "pcore_loracomm_cb"
 
+/**
+ * @brief   Automatically lock the LoRaComm during the lifetime of the usage of this class, so the task and the callers of the API do not overlap.
+ * @note    Just declare a variable with with this class inside a block of code.
+ *          When that block of code ends, deconstruct will be called and the LoRaComm unlocked. Does nothing if there is no task.
+ */
+class AutoLoRaCommLock {
+    public:
+        AutoLoRaCommLock(SemaphoreHandle_t mutex) : m_mutex(mutex) { if (m_mutex != NULL) xSemaphoreTakeRecursive(m_mutex, portMAX_DELAY); }
+        ~AutoLoRaCommLock() { if (m_mutex != NULL) xSemaphoreGiveRecursive(m_mutex); }
+    private:
+        SemaphoreHandle_t m_mutex;
+};
+
+/**
+ * @brief   Lowest SNR at which the SX127x can still demodulate a spreading factor, from the datasheet.
+ * @param   sf Spreading factor.
+ * @return  SNR in dB, SF7 = -7.5dB and each step up gains 2.5dB.
+ */
+static float adrSnrFloor(uint8_t sf) {
+    return -5.0f - (2.5f * (sf - 6));
+}
+
+/**
+ * @brief   Channel of a radioId in a channel plan.
+ * @param   radioId Radio identifier.
+ * @param   count Number of channels in the channel plan.
+ * @return  Index in the channel plan, 0 if 'count' is 0.
+ */
+static uint8_t channelOf(uint32_t radioId, uint8_t count) {
+    if (count == 0) return 0;
+    return ((radioId * 2654435761u) >> 16) % count;    // Knuth multiplicative hash, upper bits spread sequential radioIds better
+}
+
+/**
+ * @brief   Count an ACK round trip in a histogram.
+ * @param   histogram Histogram of 'LORACOMM_STATS_LATENCY_BUCKETS' buckets.
+ * @param   latency Round trip in millis.
+ */
+static void statsAckLatency(uint32_t* histogram, uint64_t latency) {
+    uint8_t bucket = 0;
+    while (bucket < (LORACOMM_STATS_LATENCY_BUCKETS-1) && latency >= ((uint64_t)LORACOMM_STATS_LATENCY_MIN << bucket)) {
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+
+/**
+ * @brief   Mark a counter in a replay window, see 'LORACOMM_CRYPTO_REPLAY_WINDOW'.
+ * @param   last Highest counter received, updated when 'counter' is higher.
+ * @param   window Bitmap of received counters, bit N is 'last'-N.
+ * @param   counter Counter received.
+ * @return  True if not received before, false if replayed or older than the window.
+ */
+static bool cryptoReplayCheck(uint32_t* last, uint32_t* window, uint32_t counter) {
+    if (counter > *last) {
+        uint32_t shift = counter - *last;
+        *window = (shift >= LORACOMM_CRYPTO_REPLAY_WINDOW) ? 0 : (*window << shift);
+        *window |= 0x1;
+        *last = counter;
+        return true;
+    }
+    uint32_t offset = *last - counter;
+    if (offset >= LORACOMM_CRYPTO_REPLAY_WINDOW || (*window & (0x1UL << offset)) != 0) {
+        return false;
+    }
+    *window |= (0x1UL << offset);
+    return true;
+}
+
+/**
+ * @brief   Build the CCM nonce of a payload, unique while the counter of the sender does not repeat.
+ * @param   nonce Where to write 'LORACOMM_CRYPTO_NONCE_SIZE' bytes.
+ * @param   radioId RadioId in the header, the Terminal in both directions.
+ * @param   flags Flags in the header, the direction is taken from 'LORACOMM_FLAG_IDX_IS_TERMINAL'.
+ * @param   counter Counter of the payload.
+ */
+static void cryptoNonce(uint8_t* nonce, uint32_t radioId, uint8_t flags, uint32_t counter) {
+    memset(nonce, 0, LORACOMM_CRYPTO_NONCE_SIZE);
+    memcpy(nonce, &radioId, sizeof(radioId));
+    nonce[sizeof(radioId)] = flags & (0x1 << LORACOMM_FLAG_IDX_IS_TERMINAL);
+    memcpy(nonce+sizeof(radioId)+1, &counter, sizeof(counter));
+}
+
 bool LoRaComm::init(
     uint8_t pinMOSI, uint8_t pinMISO, uint8_t pinSCLK, uint8_t pinCS,
     uint8_t pinReset, uint8_t pinDIO0,
     uint16_t carrierFrequency,
-    bool isTerminal, uint32_t terminalRadioId
+    bool isTerminal, uint32_t terminalRadioId,
+    SPIClass* spi
 ) {
-    bool initialized = m_lora.init(pinMOSI, pinMISO, pinSCLK, pinCS, pinReset, pinDIO0, carrierFrequency);
+    bool initialized = m_lora.init(pinMOSI, pinMISO, pinSCLK, pinCS, pinReset, pinDIO0, carrierFrequency, spi);
     if (initialized) {
         m_isTerminal = isTerminal;
         m_terminalRadioId = terminalRadioId;
+        m_initFrequency = m_lora.getFrequency();
+        m_fragmentMessageId = random(0, UINT8_MAX+1);   // so a reboot does not reuse the messageIds a receiver still remembers
         m_lora.onReceive([this](const uint8_t* payload, size_t size, int rssi, float snr) {
             this->_onReceive(payload, size, rssi, snr);
         });
+        m_lora.onTxDone([this]() {
+            this->m_rxAnchorAt = getMillis();
+            // Sent on the channel of a Terminal, go back to listen on our own
+            uint32_t frequency = this->_txFrequency(LORACOMM_RADIOID_BROADCAST);
+            if (this->m_lora.getFrequency() != frequency) {
+                this->m_lora.setFrequency(frequency);
+            }
+        });
     }
     return initialized;
 }
 
 void LoRaComm::setCryptoPhrase(uint8_t phrase) {
+    AutoLoRaCommLock lock(m_mutex);
     m_cryptoPhrase = phrase;
 }
 
+bool LoRaComm::setEncryptionKey(const uint8_t* key, uint32_t counter) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (m_cryptoEnabled) {
+        mbedtls_ccm_free(&m_ccm);
+        m_cryptoEnabled = false;
+    }
+    if (key == NULL) {
+        return true;
+    }
+
+    mbedtls_ccm_init(&m_ccm);
+    if (mbedtls_ccm_setkey(&m_ccm, MBEDTLS_CIPHER_ID_AES, key, LORACOMM_CRYPTO_KEY_SIZE*8) != 0) {
+        mbedtls_ccm_free(&m_ccm);
+        LOG_E(PINICORE_TAG_LORACOMM, "Unable to set encryption key");
+        return false;
+    }
+    m_cryptoCounter = counter;
+    // Counters received with another key mean nothing for this one
+    m_cryptoRx = {};
+    memset(m_cryptoPeers, 0, sizeof(m_cryptoPeers));
+    m_cryptoPeerCount = 0;
+    m_cryptoEnabled = true;
+    return true;
+}
+
+void LoRaComm::setCompression(bool enable, const uint8_t* dictionary, size_t size) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_compressEnabled = enable;
+    m_compressDictionary = dictionary;
+    m_compressDictionarySize = (dictionary != NULL) ? size : 0;
+    m_compressDictionaryCheck = calculateChecksum(m_compressDictionary, m_compressDictionarySize) & 0xFF;
+}
+
+void LoRaComm::setSpreadingFactor(uint8_t sf) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (m_adrRxSpreadingFactor != 0) {
+        m_adrTxSpreadingFactor = sf;    // receiving on the one assigned by ADR, this one is only used to send
+        return;
+    }
+    m_lora.setSpreadingFactor(sf);
+}
+
+void LoRaComm::setTxPower(uint8_t power) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_lora.setTxPower(power);
+}
+
+void LoRaComm::setBandwidth(ELoRaBandwidth bandwidth) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_lora.setBandwidth(bandwidth);
+}
+
+void LoRaComm::setCrc(bool enable) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_lora.setCrc(enable);
+}
+
+void LoRaComm::setLbt(bool enable) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_lbtEnabled = enable;
+}
+
+void LoRaComm::setAdr(bool enable) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_adrEnabled = enable;
+}
+
+void LoRaComm::setHeaderFormat(ELoRaHeaderFormat format) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_headerFormat = format;
+}
+
+void LoRaComm::setAggregation(uint32_t window) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_aggregateWindow = window;
+}
+
+void LoRaComm::setDutyCycle(const LoRaSubBand_t* subBands, uint8_t count) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_dutyCycle.setSubBands(subBands, count);
+}
+
+bool LoRaComm::addRadio(LoRaTxRx* radio) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (m_isTerminal || radio == NULL || m_loraExtraCount >= LORACOMM_RADIO_EXTRA_MAX) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Unable to add LoRa device, only for Gateways and up to %d", LORACOMM_RADIO_EXTRA_MAX);
+        return false;
+    }
+    for (int i=-1; i<m_loraExtraCount; ++i) {
+        LoRaTxRx* other = (i < 0) ? &m_lora : m_loraExtra[i];
+        if (other->getFrequency() == radio->getFrequency()) {
+            LOG_W(PINICORE_TAG_LORACOMM, "Unable to add LoRa device, frequency %lu already received", radio->getFrequency());
+            return false;   // every payload would be received twice
+        }
+    }
+    radio->onReceive([this](const uint8_t* payload, size_t size, int rssi, float snr) {
+        this->_onReceive(payload, size, rssi, snr);
+    });
+    m_loraExtra[m_loraExtraCount++] = radio;
+    return true;
+}
+
 void LoRaComm::maintain() {
+    if (m_task == NULL) {
+        _process();
+        return;
+    }
+
+    // Deliver only what is already in the queue, payloads arriving meanwhile wait for the next call
+    uint32_t head = m_deliveryHead.load(std::memory_order_acquire);
+    uint32_t tail = m_deliveryTail.load(std::memory_order_relaxed);
+    while (tail != head) {
+        LoRaDelivery_t* delivery = &m_delivery[tail % LORACOMM_DELIVERY_QUEUE_SIZE];
+        _deliver(delivery->radioId, delivery->tagId, delivery->payload, delivery->size, delivery->rssi, delivery->snr);
+        ++tail;
+        m_deliveryTail.store(tail, std::memory_order_release);   // slot is free again only after the callback returns
+    }
+}
+
+bool LoRaComm::startTask(BaseType_t core, UBaseType_t priority) {
+    if (m_task != NULL) return true;
+    if (m_mutex == NULL) {
+        m_mutex = xSemaphoreCreateRecursiveMutex();
+        if (m_mutex == NULL) {
+            LOG_E(PINICORE_TAG_LORACOMM, "Unable to create LoRaComm mutex");
+            return false;
+        }
+    }
+    if (xTaskCreatePinnedToCore(_task, "pcore_loracomm", LORACOMM_TASK_STACK_SIZE, this, priority, &m_task, core) != pdPASS) {
+        LOG_E(PINICORE_TAG_LORACOMM, "Unable to create LoRaComm task");
+        m_task = NULL;
+        return false;
+    }
+    return true;
+}
+
+void LoRaComm::_task(void* arg) {
+    LoRaComm* comm = (LoRaComm*)arg;
+    TickType_t lastWake = xTaskGetTickCount();
+    while (true) {
+        {
+            AutoLoRaCommLock lock(comm->m_mutex);
+            comm->_process();
+        }
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(LORACOMM_TASK_PERIOD));
+    }
+}
+
+void LoRaComm::_process() {
     m_lora.maintain();
+    for (int i=0; i<m_loraExtraCount; ++i) {
+        m_loraExtra[i]->maintain();
+    }
+    if (m_adrRxSpreadingFactor != 0 && (getMillis() - m_adrLastReceivedAt) > LORACOMM_ADR_FALLBACK_TIMEOUT) {
+        LOG_D(PINICORE_TAG_LORACOMM, "ADR fallback, nothing received from Gateway");
+        _adrSetRxSpreadingFactor(0);
+    }
+    _tdmaProcess();
+    _aggregateProcess();
+    _fragmentProcess();
+    _rxScheduleProcess();
+    _queueSendProcess();
 }
 
 void LoRaComm::enable() {
+    AutoLoRaCommLock lock(m_mutex);
+    m_rxSleeping = false;
     m_lora.enable();
+    for (int i=0; i<m_loraExtraCount; ++i) {
+        m_loraExtra[i]->enable();
+    }
 }
 
 void LoRaComm::disable() {
+    AutoLoRaCommLock lock(m_mutex);
+    m_rxSleeping = false;
     m_lora.disable();
+    for (int i=0; i<m_loraExtraCount; ++i) {
+        m_loraExtra[i]->disable();
+    }
 }
 
 bool LoRaComm::onReceive(uint8_t tagId, LoRaOnReceiveCallback callback) {
-    for (int i=0; i<LORACOMM_ONRECEIVE_SIZE_MAX; ++i) {
-        LoRaOnReceiveCallback_t* onReceive = &m_onReceiveCallbacks[i];
-        if (onReceive->tagId == LORACOMM_INVALID_TAGID) {
-            onReceive->tagId    = tagId;
-            onReceive->callback = callback;
-            return true;
-        }
-        if (onReceive->tagId == tagId) {
-            onReceive->callback = callback;
-            return true;
+    AutoLoRaCommLock lock(m_mutex);
+    if (callback == NULL || tagId >= LORACOMM_TAGID_RESERVED_MIN) return false;
+    uint8_t slot = m_onReceiveIndex[tagId];
+    if (slot == 0) {
+        if (m_onReceiveCount >= LORACOMM_ONRECEIVE_SIZE_MAX) {
+            LOG_W(PINICORE_TAG_LORACOMM, "Unable to register tagId %d, up to %d tagIds", tagId, LORACOMM_ONRECEIVE_SIZE_MAX);
+            return false;
         }
+        slot = ++m_onReceiveCount;
+        m_onReceiveTagIds[slot-1] = tagId;
+        m_onReceiveIndex[tagId] = slot;
     }
-    return false;
+    m_onReceiveCallbacks[slot-1] = callback;
+    return true;
 }
 
 void LoRaComm::removeOnReceive(uint8_t tagId) {
-    for (int i=0; i<LORACOMM_ONRECEIVE_SIZE_MAX; ++i) {
-        LoRaOnReceiveCallback_t* onReceive = &m_onReceiveCallbacks[i];
-        if (onReceive->tagId == tagId) {
-            onReceive->tagId = LORACOMM_INVALID_TAGID;
-            return;
-        }
+    AutoLoRaCommLock lock(m_mutex);
+    uint8_t slot = m_onReceiveIndex[tagId];
+    if (slot == 0) return;
+
+    // Move the last slot into the removed one, so slots in use stay contiguous
+    uint8_t last = m_onReceiveCount-1;
+    uint8_t tagIdLast = m_onReceiveTagIds[last];
+    m_onReceiveCallbacks[slot-1] = m_onReceiveCallbacks[last];
+    m_onReceiveTagIds[slot-1] = tagIdLast;
+    m_onReceiveIndex[tagIdLast] = slot;
+    m_onReceiveCallbacks[last] = NULL;
+    m_onReceiveIndex[tagId] = 0;
+    --m_onReceiveCount;
+}
+
+void LoRaComm::onReceiveAny(LoRaOnReceiveAnyCallback callback) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_onReceiveAnyCallback = callback;
+}
+
+uint8_t* LoRaComm::sendReserve(uint32_t radioId, uint8_t tagId, bool requireAck) {
+    return sendReserve(radioId, tagId, requireAck, LORA_PRIORITY_TELEMETRY);
+}
+
+uint8_t* LoRaComm::sendReserve(uint32_t radioId, uint8_t tagId, bool requireAck, ELoRaPriority priority) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (tagId >= LORACOMM_TAGID_RESERVED_MIN) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Send with reserved tagId %d", tagId);
+        return NULL;
+    }
+    if (priority == LORA_PRIORITY_ACK || priority >= LORA_PRIORITY_COUNT) {
+        priority = LORA_PRIORITY_CONTROL;   // ACK is internal only
+    }
+    LoRaSend_t* sendElement = _queueSendReserve(radioId, tagId, requireAck, false, priority);
+    return (sendElement == NULL) ? NULL : sendElement->payload;
+}
+
+bool LoRaComm::sendCommit(uint8_t* payload, size_t size) {
+    AutoLoRaCommLock lock(m_mutex);
+    LoRaSend_t* sendElement = _queueSendFromPayload(payload);
+    if (sendElement == NULL) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Send commit of a payload not reserved with 'sendReserve'");
+        return false;
+    }
+    return _queueSendCommit(sendElement, 0, size);
+}
+
+void LoRaComm::sendAbort(uint8_t* payload) {
+    AutoLoRaCommLock lock(m_mutex);
+    LoRaSend_t* sendElement = _queueSendFromPayload(payload);
+    if (sendElement != NULL) {
+        sendElement->isReserved = false;
     }
 }
 
 bool LoRaComm::send(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size) {
-    return _send(radioId, tagId, requireAck, false, payload, size);
+    return send(radioId, tagId, requireAck, payload, size, LORA_PRIORITY_TELEMETRY);
+}
+
+bool LoRaComm::send(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size, ELoRaPriority priority) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (tagId >= LORACOMM_TAGID_RESERVED_MIN) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Send with reserved tagId %d", tagId);
+        return false;
+    }
+    if (priority == LORA_PRIORITY_ACK || priority >= LORA_PRIORITY_COUNT) {
+        priority = LORA_PRIORITY_CONTROL;   // ACK is internal only
+    }
+    if (size > LORACOMM_SEND_PAYLOAD_MAX) {
+        return _fragmentSend(radioId, tagId, payload, size, priority);
+    }
+    if (m_aggregateWindow != 0 && priority == LORA_PRIORITY_TELEMETRY && size <= LORACOMM_AGGREGATE_RECORD_MAX) {
+        return _aggregateAdd(radioId, tagId, requireAck, payload, size);
+    }
+    return _send(radioId, tagId, requireAck, false, payload, size, priority);
+}
+
+bool LoRaComm::setTdma(uint32_t period, uint16_t slotTime) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (period == 0) {
+        m_tdmaBeacon = {};
+        m_tdmaBeaconAt = 0;
+        return true;
+    }
+    if (slotTime == 0 || period < (uint32_t)(LORACOMM_TDMA_BEACON_GUARD + slotTime)) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Invalid TDMA: [period: %lu] [slotTime: %d]", period, slotTime);
+        return false;
+    }
+    uint32_t slotCount = (period - LORACOMM_TDMA_BEACON_GUARD) / slotTime;
+    m_tdmaBeacon.period    = period;
+    m_tdmaBeacon.slotTime  = slotTime;
+    m_tdmaBeacon.slotCount = (slotCount > UINT16_MAX) ? UINT16_MAX : slotCount;
+    m_tdmaBeaconAt = getMillis();   // first beacon right away
+    return true;
+}
+
+void LoRaComm::setRxSchedule(uint32_t window, uint32_t wakePeriod) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_rxWindow = window;
+    m_rxWakePeriod = wakePeriod;
+    m_rxAnchorAt = getMillis();
+    if (window == 0 && m_rxSleeping) {
+        enable();
+    }
+}
+
+bool LoRaComm::setRelay(const uint32_t* radioIds, uint8_t count) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (!m_isTerminal) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Relay is only for Terminals");
+        return false;
+    }
+    if (count > LORACOMM_RELAY_ROUTE_MAX || (count > 0 && radioIds == NULL)) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Invalid relay routes, up to %d radioIds", LORACOMM_RELAY_ROUTE_MAX);
+        return false;
+    }
+    if (count > 0) {
+        memcpy(m_relayRoutes, radioIds, count * sizeof(uint32_t));
+    }
+    m_relayRouteCount = count;
+    return true;
+}
+
+void LoRaComm::setHeaderUnchecked(bool enable) {
+    AutoLoRaCommLock lock(m_mutex);
+    m_headerUnchecked = enable;
+}
+
+bool LoRaComm::setChannelPlan(const uint32_t* frequencies, uint8_t count) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (count > LORACOMM_CHANNEL_COUNT_MAX || (count > 0 && frequencies == NULL)) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Invalid channel plan, up to %d channels", LORACOMM_CHANNEL_COUNT_MAX);
+        return false;
+    }
+    uint8_t channel = m_isTerminal ? channelOf(m_terminalRadioId, count) : m_channel;
+    if (channel >= count) {
+        channel = 0;
+    }
+    uint32_t frequency = (count > 0) ? frequencies[channel] : m_initFrequency;
+    if (!m_lora.setFrequency(frequency)) return false;
+
+    if (count > 0) {
+        memcpy(m_channelFrequencies, frequencies, count*sizeof(uint32_t));
+    }
+    m_channelCount = count;
+    m_channel = channel;
+    LOG_I(PINICORE_TAG_LORACOMM, "Channel plan set: [count: %d] [channel: %d] [frequency: %lu]", count, channel, frequency);
+    return true;
+}
+
+bool LoRaComm::setChannel(uint8_t channel) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (channel >= m_channelCount) return false;
+    if (!m_lora.setFrequency(m_channelFrequencies[channel])) return false;
+    m_channel = channel;
+    return true;
+}
+
+uint8_t LoRaComm::getChannelOf(uint32_t radioId) {
+    return channelOf(radioId, m_channelCount);
+}
+
+const LoRaSignalQuality_t* LoRaComm::getSignalQuality(uint32_t radioId) {
+    return _findSignalQuality(radioId, false);
+}
+
+const LoRaSignalQuality_t* LoRaComm::getSignalQualityNext(uint16_t* iterator) {
+    if (iterator == NULL) return NULL;
+    while (*iterator < LORACOMM_SIGNAL_QUALITY_COUNT_MAX) {
+        LoRaSignalQuality_t* signalQuality = &m_signalQuality[(*iterator)++];
+        if (signalQuality->lastUpdateAt != 0) {
+            return signalQuality;
+        }
+    }
+    return NULL;
 }
 
 void LoRaComm::getStatistics(LoRaStatistics_t* stats) {
+    AutoLoRaCommLock lock(m_mutex);
     if (stats == NULL) return;
     stats->bytesSent       = m_lora.statsBytesSent();
     stats->bytesReceived   = m_lora.statsBytesReceived();
     stats->packetsSent     = m_lora.statsPacketsSent();
     stats->packetsReceived = m_lora.statsPacketsReceived();
+    stats->packetsDropped  = m_lora.statsPacketsDropped();
+    stats->packetsDuplicated = m_statsPacketsDuplicated;
+    stats->packetsCrcError = m_lora.statsPacketsCrcError();
+    stats->packetsInvalid  = m_statsPacketsInvalid;
+    stats->packetsFiltered = m_statsPacketsFiltered;
+    stats->packetsRelayed  = m_statsPacketsRelayed;
+    stats->packetsUndelivered = m_statsPacketsUndelivered;
+    memcpy(stats->ackLatency, m_statsAckLatency, sizeof(stats->ackLatency));
+    for (int i=0; i<m_loraExtraCount; ++i) {
+        LoRaTxRx* radio = m_loraExtra[i];
+        stats->bytesReceived   += radio->statsBytesReceived();
+        stats->packetsReceived += radio->statsPacketsReceived();
+        stats->packetsDropped  += radio->statsPacketsDropped();
+        stats->packetsCrcError += radio->statsPacketsCrcError();
+    }
 }
 
+void LoRaComm::getTagStatistics(uint8_t tagId, LoRaTagStatistics_t* stats) {
+    AutoLoRaCommLock lock(m_mutex);
+    if (stats == NULL) return;
+    memcpy(stats, _statsTagOf(tagId), sizeof(LoRaTagStatistics_t));
+}
 
-void LoRaComm::_onReceive(const uint8_t* payload, size_t size, int rssi, float snr) {
-    int sizeContent = size-sizeof(LoRaHeader_t);    // size of actual payload, excluding header
-    if (
-        sizeContent <= 0  // must contain space least 1 byte of usable payload, otherwise goes inside this 'IF'
-    ) {
-        LOG_T(PINICORE_TAG_LORACOMM_CB, "Received unknown payload: [size: %d] [rssi: %d] [snr: %0.2f]", size, rssi, snr);
-        return;
-    }
 
-    const uint8_t* payloadContent = payload+sizeof(LoRaHeader_t);
-    uint32_t checksum = calculateChecksum(payloadContent, sizeContent, m_cryptoPhrase);
-    LoRaHeader_t* header = (LoRaHeader_t*)payload;
-    if (header->checksum != checksum) {
-        LOG_T(PINICORE_TAG_LORACOMM_CB, "Checksum mismatch: [expected: 0x%x] [actual: 0x%x]", header->checksum, checksum);
+void LoRaComm::_onReceive(const uint8_t* payload, size_t size, int rssi, float snr) {
+    LoRaHeader_t headerDecoded;
+    ELoRaHeaderFormat format;
+    size_t sizeHeader = _headerDecode(payload, size, &headerDecoded, &format);
+    if (sizeHeader == 0) {
+        ++m_statsPacketsInvalid;
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Received unknown payload or checksum mismatch: [size: %d] [rssi: %d] [snr: %0.2f]", size, rssi, snr);
         return;
     }
 
+    LoRaHeader_t* header = &headerDecoded;
+    const uint8_t* payloadContent = payload+sizeHeader;
+    int sizeContent = size-sizeHeader;    // size of actual payload, excluding header
     uint32_t radioId = header->radioId;
     uint8_t tagId = header->tagId;
     LOG_D(PINICORE_TAG_LORACOMM_CB, "Received: [radioId: %d] [tagId: %d] [size: %d] [rssi: %d] [snr: %0.2f]", radioId, tagId, size, rssi, snr);
+    if (radioId == LORACOMM_RADIOID_BROADCAST) {
+        if (m_isTerminal && tagId == LORACOMM_TAGID_BEACON) {
+            _tdmaOnBeacon(payloadContent, sizeContent);
+        }
+        return; // Broadcasts are only internal payloads, a Gateway ignores beacons of other Gateways
+    }
+    bool fromTerminal = (header->flags & (0x1 << LORACOMM_FLAG_IDX_IS_TERMINAL)) != 0;
+    if (!m_isTerminal && !fromTerminal) {
+        ++m_statsPacketsFiltered;
+        return; // Sent by a Gateway, my own forwarded back by a relay or one of another Gateway
+    }
+    if (m_isTerminal && m_terminalRadioId == radioId && fromTerminal) {
+        ++m_statsPacketsFiltered;
+        return; // My own forwarded by a relay, a relay still forwards both directions for the radioIds it serves
+    }
     if (m_isTerminal && m_terminalRadioId != radioId) {
+        if (m_relayRouteCount != 0 && _relayHasRoute(radioId)) {
+            _relayForward(header, format, payloadContent, sizeContent);
+            return;
+        }
+        ++m_statsPacketsFiltered;
         return; // Discard payloads not directed to me if I am a Terminal (not a Gateway)
     }
+
+    uint8_t plain[LORA_PACKET_MAX_SIZE];
+    uint32_t cryptoCounter = 0;
+    if (tagId == LORACOMM_TAGID_ENCRYPTED) {
+        size_t sizePlain = _decrypt(header, payloadContent, sizeContent, plain, &cryptoCounter);
+        if (sizePlain == 0) {
+            ++m_statsPacketsInvalid;
+            LOG_T(PINICORE_TAG_LORACOMM_CB, "Received encrypted payload with MIC mismatch: [radioId: %d] [size: %d]", radioId, size);
+            return;
+        }
+        tagId = plain[0];
+        payloadContent = plain+1;
+        sizeContent = sizePlain-1;
+    }
+    else if (m_cryptoEnabled) {
+        ++m_statsPacketsInvalid;
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Received payload without encryption: [radioId: %d] [tagId: %d]", radioId, tagId);
+        return;
+    }
+
+    uint8_t inflated[LORACOMM_SEND_PAYLOAD_MAX];
+    if (tagId == LORACOMM_TAGID_COMPRESSED) {
+        size_t sizeInflated = _decompress(payloadContent, sizeContent, inflated, &tagId);
+        if (sizeInflated == 0) {
+            ++m_statsPacketsInvalid;
+            LOG_T(PINICORE_TAG_LORACOMM_CB, "Received compressed payload with another dictionary or invalid: [radioId: %d] [size: %d]", radioId, size);
+            return;
+        }
+        payloadContent = inflated;
+        sizeContent = sizeInflated;
+    }
+    if (tagId >= LORACOMM_TAGID_RESERVED_MIN && tagId < LORACOMM_TAGID_AGGREGATE) {
+        // Only the internal payloads handled below are reserved tagIds that can be received, also once decrypted or decompressed
+        ++m_statsPacketsInvalid;
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Received reserved tagId: [radioId: %d] [tagId: %d]", radioId, tagId);
+        return;
+    }
     
-    _updateSignalQuality(radioId, rssi, snr);
+    LoRaTagStatistics_t* tagStats = _statsTagOf(tagId);
+    ++tagStats->packetsReceived;
+    tagStats->bytesReceived += size;
+    _updateSignalQuality(radioId, size, rssi, snr, header->hops);
+    if (m_isTerminal) {
+        m_adrLastReceivedAt = getMillis();
+    }
 
     bool isAck = (header->flags & (0x1 << LORACOMM_FLAG_IDX_IS_ACK)) != 0;
+    bool requireAck = (header->flags & (0x1 << LORACOMM_FLAG_IDX_REQUIRE_ACK)) != 0;
+    LoRaCryptoPeer_t* cryptoPeer = (cryptoCounter != 0) ? _cryptoPeer(radioId) : NULL;
+    if (cryptoCounter != 0 && cryptoPeer == NULL) {
+        ++m_statsPacketsInvalid;
+        LOG_W(PINICORE_TAG_LORACOMM_CB, "Encrypted payload dropped, tracking the counter of %d radioIds already: [radioId: %d]", LORACOMM_CRYPTO_PEER_MAX, radioId);
+        return;
+    }
+    if (cryptoPeer != NULL && !cryptoReplayCheck(&cryptoPeer->counter, &cryptoPeer->window, cryptoCounter)) {
+        // Also a retry whose ACK was lost, ACK it again so the sender stops
+        if (requireAck && !isAck) {
+            _sendAck(radioId, tagId, header->checksum, format);
+        }
+        ++m_statsPacketsDuplicated;
+        LOG_D(PINICORE_TAG_LORACOMM_CB, "Encrypted payload received again, not delivered: [radioId: %d] [tagId: %d] [counter: %u]", radioId, tagId, cryptoCounter);
+        return;
+    }
+
     if (isAck) {
-        LOG_W(PINICORE_TAG_LORACOMM_CB, "ACK received! TODO: handle send queue by removing that 'radioId' and 'checksum' that is in the payload, from the send queue");
+        if (sizeContent < (int)sizeof(uint32_t)) {
+            LOG_T(PINICORE_TAG_LORACOMM_CB, "Received ACK without checksum: [radioId: %d] [size: %d]", radioId, size);
+            return;
+        }
+        uint32_t checksumAcked;
+        memcpy(&checksumAcked, payloadContent, sizeof(checksumAcked));
+        if (_queueSendAck(radioId, checksumAcked)) {
+            LOG_D(PINICORE_TAG_LORACOMM_CB, "ACK received: [radioId: %d] [checksum: 0x%x]", radioId, checksumAcked);
+        }
+        else {
+            LOG_T(PINICORE_TAG_LORACOMM_CB, "ACK received for unknown payload: [radioId: %d] [checksum: 0x%x]", radioId, checksumAcked);
+        }
         return;
     }
-    
-    for (int i=0; i<LORACOMM_ONRECEIVE_SIZE_MAX; ++i) {
-        LoRaOnReceiveCallback_t* onReceive = &m_onReceiveCallbacks[i];
-        if (onReceive->tagId == tagId) {
-            onReceive->callback(radioId, payload, size, rssi, snr);
-            break;
+
+    if (requireAck) {
+        _sendAck(radioId, tagId, header->checksum, format);
+        if (_dedupCheck(radioId, header->seq, header->checksum, LORACOMM_DEDUP_WINDOW)) {
+            ++m_statsPacketsDuplicated;
+            LOG_D(PINICORE_TAG_LORACOMM_CB, "Duplicate received, ACK sent again: [radioId: %d] [tagId: %d] [checksum: 0x%x]", radioId, tagId, header->checksum);
+            return;
+        }
+    }
+    else if (_relayHops(radioId) != 0) {
+        // Behind a relay, the same payload may be received directly and forwarded
+        if (_dedupCheck(radioId, header->seq, header->checksum, LORACOMM_RELAY_DEDUP_WINDOW)) {
+            ++m_statsPacketsDuplicated;
+            LOG_D(PINICORE_TAG_LORACOMM_CB, "Duplicate received through relay: [radioId: %d] [tagId: %d] [hops: %d]", radioId, tagId, header->hops);
+            return;
         }
     }
+    
+    switch (tagId) {
+        case LORACOMM_TAGID_ADR:
+            if (m_isTerminal && sizeContent >= 1) {
+                uint8_t sf = payloadContent[0];
+                if (sf < LORACOMM_ADR_SF_MIN || sf > 12) {
+                    LOG_W(PINICORE_TAG_LORACOMM_CB, "Received ADR with invalid spreading factor: [sf: %d]", sf);
+                    return;
+                }
+                _adrSetRxSpreadingFactor(sf);
+            }
+            return;
+        case LORACOMM_TAGID_FRAGMENT:
+            _fragmentOnReceive(radioId, payloadContent, sizeContent, rssi, snr);
+            return;
+        case LORACOMM_TAGID_FRAGMENT_ACK:
+            _fragmentOnAck(radioId, payloadContent, sizeContent);
+            return;
+        case LORACOMM_TAGID_AGGREGATE:
+            _aggregateOnReceive(radioId, payloadContent, sizeContent, rssi, snr);
+            return;
+    }
+
+    _dispatch(radioId, tagId, payloadContent, sizeContent, rssi, snr);
+}
+
+void LoRaComm::_dispatch(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr) {
+    if (m_task == NULL) {
+        _deliver(radioId, tagId, payload, size, rssi, snr);
+        return;
+    }
+
+    uint32_t head = m_deliveryHead.load(std::memory_order_relaxed);
+    uint32_t tail = m_deliveryTail.load(std::memory_order_acquire);
+    if ((head - tail) >= LORACOMM_DELIVERY_QUEUE_SIZE || size > LORACOMM_MESSAGE_SIZE_MAX) {
+        ++m_statsPacketsUndelivered;
+        LOG_W(PINICORE_TAG_LORACOMM_CB, "Delivery queue full, dropped: [radioId: %d] [tagId: %d]", radioId, tagId);
+        return;
+    }
+    LoRaDelivery_t* delivery = &m_delivery[head % LORACOMM_DELIVERY_QUEUE_SIZE];
+    delivery->radioId = radioId;
+    delivery->tagId   = tagId;
+    delivery->rssi    = rssi;
+    delivery->snr     = snr;
+    delivery->size    = size;
+    memcpy(delivery->payload, payload, size);
+    m_deliveryHead.store(head + 1, std::memory_order_release);
+}
+
+void LoRaComm::_deliver(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr) {
+    uint8_t slot = m_onReceiveIndex[tagId];
+    if (slot != 0) {
+        m_onReceiveCallbacks[slot-1](radioId, payload, size, rssi, snr);
+    }
+    else if (m_onReceiveAnyCallback != NULL) {
+        m_onReceiveAnyCallback(radioId, tagId, payload, size, rssi, snr);
+    }
 }
 
-bool LoRaComm::_send(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, const uint8_t* payload, size_t size) {
+bool LoRaComm::_send(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, const uint8_t* payload, size_t size, ELoRaPriority priority) {
     if (size > LORACOMM_SEND_PAYLOAD_MAX) {
         LOG_W(PINICORE_TAG_LORACOMM, "Send payload too large (%d bytes), max %d bytes", size, LORACOMM_SEND_PAYLOAD_MAX);
         return false;
     }
 
-    uint8_t payloadFull[LORA_PACKET_MAX_SIZE];
-    memset(payloadFull, 0, sizeof(payloadFull));
-    LoRaHeader_t header;
-    size_t sizeFull = sizeof(header)+size;
-    header.checksum = calculateChecksum(payload, size, m_cryptoPhrase);
-    header.radioId = radioId;
-    header.flags =
-        ((m_isTerminal ? 1:0) << LORACOMM_FLAG_IDX_IS_TERMINAL) |
-        ((requireAck   ? 1:0) << LORACOMM_FLAG_IDX_REQUIRE_ACK) |
-        ((isAck        ? 1:0) << LORACOMM_FLAG_IDX_IS_ACK);
-    header.tagId = tagId;
-    memcpy(payloadFull, &header, sizeof(header));       // place header
-    memcpy(payloadFull+sizeof(header), payload, size);  // place content
-
-    LOG_W(PINICORE_TAG_LORACOMM, "TODO: place in a send queue, manage it and handle ACK when requested");
-    m_lora.send(payloadFull, sizeFull);
-    return true;
+    LoRaSend_t* sendElement = _queueSendReserve(radioId, tagId, requireAck, isAck, priority);
+    if (sendElement == NULL) return false;
+    memcpy(sendElement->payload, payload, size);    // only copy, straight into the send queue
+    return _queueSendCommit(sendElement, 0, size);
 }
 
-bool LoRaComm::_sendAck(uint32_t radioId, uint8_t tagId, uint32_t checksumOfReceived) {
-    return _send(radioId, tagId, false, true, (uint8_t*)checksumOfReceived, sizeof(checksumOfReceived));
+bool LoRaComm::_sendAck(uint32_t radioId, uint8_t tagId, uint32_t checksumOfReceived, ELoRaHeaderFormat format) {
+    LoRaSend_t* sendElement = _queueSendReserve(radioId, tagId, false, true, LORA_PRIORITY_ACK);
+    if (sendElement == NULL) return false;
+    sendElement->headerFormat = format;
+    memcpy(sendElement->payload, &checksumOfReceived, sizeof(checksumOfReceived));
+    return _queueSendCommit(sendElement, 0, sizeof(checksumOfReceived));
 }
 
-void LoRaComm::_updateSignalQuality(uint32_t radioId, int rssi, float snr) {
-    if (!m_isTerminal) {
-        return; // I am not a Gateway, so ignore all signal quality logic
-    }
+void LoRaComm::_tdmaProcess() {
+    if (m_tdmaBeaconAt == 0) return;
 
     uint64_t currMillis = getMillis();
-    uint64_t oldest = UINT64_MAX;
-    int oldestIdx = 0;   // Guaranteed to be set at least once, but keeping '0' just in case of an edge case
-    int selectedIdx = -1;
-    LoRaSignalQuality_t* signalQuality;
-
-    // Search for same radioId or oldest element
-    for (int i=0; i<LORACOMM_SIGNAL_QUALITY_COUNT_MAX; ++i) {
-        signalQuality = &m_signalQuality[i];
-        if (signalQuality->lastUpdateAt < oldest) {
-            // Found an older element, update the oldestIdx
-            oldestIdx = i;
-        }
-        if (signalQuality->radioId == radioId || signalQuality->lastUpdateAt == 0) {
-            // Found same of empty element, select it and use it
-            selectedIdx = i;
-            break;
+    if (m_isTerminal) {
+        if ((currMillis - m_tdmaBeaconAt) > ((uint64_t)m_tdmaBeacon.period * LORACOMM_TDMA_BEACON_LOST_MAX)) {
+            LOG_D(PINICORE_TAG_LORACOMM, "TDMA beacon lost, sending at any time");
+            m_tdmaBeaconAt = 0;
         }
+        return;
     }
 
-    if (selectedIdx != -1) { // Selecting same element, updating its old data
-        signalQuality = &m_signalQuality[selectedIdx];
+    if (currMillis < m_tdmaBeaconAt) return;
+    if (_send(LORACOMM_RADIOID_BROADCAST, LORACOMM_TAGID_BEACON, false, false, (uint8_t*)&m_tdmaBeacon, sizeof(m_tdmaBeacon), LORA_PRIORITY_CONTROL)) {
+        m_tdmaBeaconAt = currMillis + m_tdmaBeacon.period;
     }
-    else { // Could not find any element with same radioId, replace the oldest one in the data structure
-        signalQuality = &m_signalQuality[oldestIdx];
+}
+
+void LoRaComm::_tdmaOnBeacon(const uint8_t* content, size_t size) {
+    if (size < sizeof(LoRaBeacon_t)) return;
+    LoRaBeacon_t beacon;
+    memcpy(&beacon, content, sizeof(beacon));
+    if (beacon.period == 0 || beacon.slotTime == 0 || beacon.slotCount == 0) return;
+
+    m_tdmaBeacon = beacon;
+    m_tdmaBeaconAt = getMillis();
+    m_tdmaSlot = ((m_terminalRadioId * 2246822519u) >> 16) % beacon.slotCount;    // other multiplier than the channel plan, so slots do not follow the channel
+    LOG_T(PINICORE_TAG_LORACOMM_CB, "TDMA beacon: [period: %lu] [slotTime: %d] [slotCount: %d] [slot: %d]", beacon.period, beacon.slotTime, beacon.slotCount, m_tdmaSlot);
+}
+
+uint32_t LoRaComm::_tdmaGetWaitTime(uint32_t airtime) {
+    if (!m_isTerminal || m_tdmaBeaconAt == 0) return 0;
+
+    uint32_t period = m_tdmaBeacon.period;
+    uint32_t slotStart = LORACOMM_TDMA_BEACON_GUARD + (m_tdmaSlot * m_tdmaBeacon.slotTime) + LORACOMM_TDMA_SLOT_GUARD;
+    uint32_t slotEnd = LORACOMM_TDMA_BEACON_GUARD + ((m_tdmaSlot+1) * m_tdmaBeacon.slotTime);
+    uint32_t sendEnd = slotEnd - (airtime / 1000);
+    if (sendEnd < slotStart) {
+        sendEnd = slotStart;    // payload longer than the slot, send at its start anyway
     }
 
-    signalQuality->lastUpdateAt = currMillis;
-    signalQuality->radioId = radioId;
-    signalQuality->rssi = rssi;
-    signalQuality->snr = snr;
+    uint32_t elapsed = (getMillis() - m_tdmaBeaconAt) % period;
+    if (elapsed < slotStart) return slotStart - elapsed;
+    if (elapsed <= sendEnd) return 0;
+    return (period - elapsed) + slotStart;  // slot of the next period
 }
 
-bool LoRaComm::_queueSendAdd(bool requiresACK, uint64_t delay, size_t payloadSize, uint8_t* payload) {
-    if (payloadSize > LORA_PACKET_MAX_SIZE) {
-        LOG_D(PINICORE_TAG_LORACOMM, "Unable to queue payload for send, payload size too big");
-        return false; // payload too big
+void LoRaComm::_rxScheduleProcess() {
+    if (!m_isTerminal || m_rxWindow == 0) return;
+    if (!isEnabled() && !m_rxSleeping) return;  // disabled by the user
+
+    uint64_t elapsed = getMillis() - m_rxAnchorAt;
+    bool awake =
+        (elapsed < m_rxWindow) ||
+        (m_rxWakePeriod != 0 && (elapsed % m_rxWakePeriod) < m_rxWindow) ||
+        m_lora.isTransmitting() ||
+        (_queueSendGetReady() != NULL);
+    if (awake && m_rxSleeping) {
+        m_rxSleeping = false;
+        m_lora.enable();
     }
+    else if (!awake && !m_rxSleeping) {
+        m_lora.disable();
+        m_rxSleeping = true;
+    }
+}
 
-    uint64_t currMillis = getMillis();
-    for (int i=0; i<LORACOMM_SEND_QUEUE_MAX; ++i) {
-        LoRaSend_t* sendElement = &m_sendQueue[i];
-        if (sendElement->payloadSize == 0) {
-            sendElement->requiresACK = requiresACK;
-            sendElement->retryCount = 0;
-            uint64_t nextRetryAt = currMillis + delay;
-            sendElement->nextRetryAt = nextRetryAt;
-            sendElement->payloadSize = payloadSize;
-            memcpy(sendElement->payload, payload, payloadSize);
-            LOG_D(PINICORE_TAG_LORACOMM, "Added to send queue: [payloadSize: %d] [requiresACK: %d] [nextRetryAt: %llu]", payloadSize, requiresACK, nextRetryAt);
-            return true; // payload queued for send
-        }
+uint32_t LoRaComm::_rxScheduleGetWaitTime(uint32_t radioId, uint32_t airtime) {
+    if (m_isTerminal || m_rxWindow == 0 || radioId == LORACOMM_RADIOID_BROADCAST) return 0;
+    LoRaSignalQuality_t* signalQuality = _findSignalQuality(radioId, false);
+    if (signalQuality == NULL) return 0;
+
+    uint32_t margin = (airtime / 1000) + LORACOMM_RX_SCHEDULE_GUARD;
+    uint32_t sendEnd = (m_rxWindow > margin) ? (m_rxWindow - margin) : 0;
+    uint64_t elapsed = getMillis() - signalQuality->lastUpdateAt;
+    if (m_rxWakePeriod == 0) {
+        return (elapsed <= sendEnd) ? 0 : LORACOMM_RX_SCHEDULE_POLL;
     }
+    uint32_t offset = elapsed % m_rxWakePeriod;
+    return (offset <= sendEnd) ? 0 : (m_rxWakePeriod - offset);
+}
 
-    LOG_D(PINICORE_TAG_LORACOMM, "Send queue is full");
-    return false; // queue currently full
+size_t LoRaComm::_compress(LoRaSend_t* sendElement, size_t size) {
+    if (size <= LORACOMM_COMPRESS_OVERHEAD+1) {
+        return size;
+    }
+    uint8_t compressed[LORACOMM_SEND_PAYLOAD_MAX];
+    size_t sizeData = compressLz(
+        sendElement->payload, size,
+        compressed+LORACOMM_COMPRESS_OVERHEAD, size-LORACOMM_COMPRESS_OVERHEAD-1,   // only worth it if smaller
+        m_compressDictionary, m_compressDictionarySize
+    );
+    if (sizeData == 0) {
+        return size;
+    }
+    compressed[0] = sendElement->header.tagId;
+    compressed[1] = m_compressDictionaryCheck;
+    memcpy(sendElement->payload, compressed, LORACOMM_COMPRESS_OVERHEAD+sizeData);
+    sendElement->isCompressed = true;
+    return LORACOMM_COMPRESS_OVERHEAD+sizeData;
 }
 
-void LoRaComm::_queueSendRemove(LoRaSend_t* sendElement) {
-    if (sendElement == NULL) return;
-    sendElement->payloadSize = 0;
+size_t LoRaComm::_decompress(const uint8_t* content, size_t size, uint8_t* out, uint8_t* tagId) {
+    if (size <= LORACOMM_COMPRESS_OVERHEAD || content[1] != m_compressDictionaryCheck) {
+        return 0;
+    }
+    *tagId = content[0];
+    return decompressLz(
+        content+LORACOMM_COMPRESS_OVERHEAD, size-LORACOMM_COMPRESS_OVERHEAD,
+        out, LORACOMM_SEND_PAYLOAD_MAX,
+        m_compressDictionary, m_compressDictionarySize
+    );
 }
 
-LoRaSend_t* LoRaComm::_queueSendGetReady() {
-    uint64_t currMillis = getMillis();
-    for (int i=0; i<LORACOMM_SEND_QUEUE_MAX; ++i) {
-        LoRaSend_t* sendElement = &m_sendQueue[i];
-        if (
-            sendElement->payloadSize != 0 &&
-            sendElement->nextRetryAt <= currMillis
-        ) {
-            return &m_sendQueue[i];
-        }
+size_t LoRaComm::_encrypt(LoRaSend_t* sendElement, size_t size) {
+    LoRaHeader_t* header = &sendElement->header;
+    uint8_t* payload = sendElement->payload;
+    uint32_t counter = ++m_cryptoCounter;
+    memmove(payload+sizeof(counter)+1, payload, size);
+    memcpy(payload, &counter, sizeof(counter));
+    payload[sizeof(counter)] = sendElement->isCompressed ? LORACOMM_TAGID_COMPRESSED : header->tagId;
+
+    uint8_t nonce[LORACOMM_CRYPTO_NONCE_SIZE];
+    cryptoNonce(nonce, header->radioId, header->flags, counter);
+    uint8_t aad[sizeof(uint32_t)+1];    // radioId and flags are sent in clear, authenticate them
+    memcpy(aad, &header->radioId, sizeof(uint32_t));
+    aad[sizeof(uint32_t)] = header->flags & LORACOMM_FLAG_MASK;
+
+    uint8_t* data = payload+sizeof(counter);
+    size_t sizeData = size+1;
+    if (mbedtls_ccm_encrypt_and_tag(&m_ccm, sizeData, nonce, sizeof(nonce), aad, sizeof(aad), data, data, data+sizeData, LORACOMM_CRYPTO_MIC_SIZE) != 0) {
+        LOG_E(PINICORE_TAG_LORACOMM, "Unable to encrypt payload: [radioId: %d] [tagId: %d]", header->radioId, header->tagId);
+        return 0;
     }
-    return NULL;
+    sendElement->isEncrypted = true;
+    return size + LORACOMM_CRYPTO_OVERHEAD;
+}
+
+size_t LoRaComm::_decrypt(const LoRaHeader_t* header, const uint8_t* content, size_t size, uint8_t* plain, uint32_t* counter) {
+    if (!m_cryptoEnabled || size <= LORACOMM_CRYPTO_OVERHEAD) {
+        return 0;
+    }
+    memcpy(counter, content, sizeof(uint32_t));
+    if (*counter == 0) {
+        return 0;   // never sent, it means no counter received
+    }
+
+    uint8_t nonce[LORACOMM_CRYPTO_NONCE_SIZE];
+    cryptoNonce(nonce, header->radioId, header->flags, *counter);
+    uint8_t aad[sizeof(uint32_t)+1];
+    memcpy(aad, &header->radioId, sizeof(uint32_t));
+    aad[sizeof(uint32_t)] = header->flags & LORACOMM_FLAG_MASK;
+
+    const uint8_t* data = content+sizeof(uint32_t);
+    size_t sizeData = size-sizeof(uint32_t)-LORACOMM_CRYPTO_MIC_SIZE;
+    if (mbedtls_ccm_auth_decrypt(&m_ccm, sizeData, nonce, sizeof(nonce), aad, sizeof(aad), data, plain, data+sizeData, LORACOMM_CRYPTO_MIC_SIZE) != 0) {
+        return 0;
+    }
+    return sizeData;
+}
+
+LoRaCryptoPeer_t* LoRaComm::_cryptoPeer(uint32_t radioId) {
+    if (m_isTerminal) {
+        return &m_cryptoRx;
+    }
+
+    const uint32_t mask = LORACOMM_CRYPTO_PEER_MAX-1;
+    const uint8_t bits = __builtin_ctz(LORACOMM_CRYPTO_PEER_MAX);
+    uint32_t idx = (bits == 0) ? 0 : ((radioId * 2654435761u) >> (32 - bits));
+    for (uint32_t i=0; i<LORACOMM_CRYPTO_PEER_MAX; ++i) {
+        LoRaCryptoPeer_t* peer = &m_cryptoPeers[(idx+i) & mask];
+        if (peer->counter == 0) {
+            if (m_cryptoPeerCount >= LORACOMM_CRYPTO_PEER_MAX-1) {
+                return NULL;    // keep one empty, so lookups of unknown radioIds always end
+            }
+            ++m_cryptoPeerCount;
+            peer->radioId = radioId;
+            peer->window  = 0;
+            return peer;    // counter set by the caller, never 0 for a payload received
+        }
+        if (peer->radioId == radioId) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+bool LoRaComm::_dedupCheck(uint32_t radioId, uint8_t seq, uint32_t checksum, uint32_t window) {
+    uint64_t currMillis = getMillis();
+    LoRaDedup_t* expired = NULL;
+    for (int i=0; i<LORACOMM_DEDUP_CACHE_SIZE; ++i) {
+        LoRaDedup_t* dedup = &m_dedupCache[i];
+        if (dedup->receivedAt == 0 || (currMillis - dedup->receivedAt) > dedup->window) {
+            if (expired == NULL) expired = dedup;
+            continue;
+        }
+        if (dedup->radioId == radioId && dedup->seq == seq && dedup->checksum == checksum) {
+            return true;
+        }
+    }
+
+    if (expired == NULL) {
+        // All in use, replace in order of insertion
+        expired = &m_dedupCache[m_dedupNext];
+        m_dedupNext = (m_dedupNext + 1) % LORACOMM_DEDUP_CACHE_SIZE;
+    }
+    expired->receivedAt = currMillis;
+    expired->radioId    = radioId;
+    expired->checksum   = checksum;
+    expired->seq        = seq;
+    expired->window     = window;
+    return false;
+}
+
+bool LoRaComm::_relayHasRoute(uint32_t radioId) {
+    for (int i=0; i<m_relayRouteCount; ++i) {
+        if (m_relayRoutes[i] == radioId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LoRaComm::_relayForward(const LoRaHeader_t* header, ELoRaHeaderFormat format, const uint8_t* content, size_t size) {
+    // Always remember, but only a copy from another relay is dropped, the same payload with 0 hops is a retry of the sender
+    bool isCopy = _dedupCheck(header->radioId, header->seq, header->checksum, LORACOMM_RELAY_DEDUP_WINDOW);
+    if (header->hops > 0 && isCopy) {
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Relay copy already forwarded: [radioId: %d] [tagId: %d] [hops: %d]", header->radioId, header->tagId, header->hops);
+        return;
+    }
+    if (header->hops >= LORACOMM_RELAY_HOPS_MAX) {
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Relay hops limit reached: [radioId: %d] [tagId: %d]", header->radioId, header->tagId);
+        return;
+    }
+
+    bool isAck = (header->flags & (0x1 << LORACOMM_FLAG_IDX_IS_ACK)) != 0;
+    LoRaSend_t* sendElement = _queueSendReserve(header->radioId, header->tagId, false, isAck, LORA_PRIORITY_CONTROL);
+    if (sendElement == NULL) return;
+    if (size > sizeof(sendElement->payload)) {
+        sendElement->isReserved = false;
+        return;
+    }
+
+    // Sent as received, the sender keeps its flags and retries, this relay only adds a hop
+    memcpy(&sendElement->header, header, sizeof(LoRaHeader_t));
+    ++sendElement->header.hops;
+    sendElement->headerFormat = format;
+    memcpy(sendElement->payload, content, size);
+    if (_queueSendEnqueue(sendElement, 0, size)) {
+        ++m_statsPacketsRelayed;
+        LOG_D(PINICORE_TAG_LORACOMM_CB, "Relay forwarding: [radioId: %d] [tagId: %d] [hops: %d]", header->radioId, header->tagId, sendElement->header.hops);
+    }
+}
+
+uint8_t LoRaComm::_relayHops(uint32_t radioId) {
+    if (m_isTerminal) {
+        return m_relayRxHops;
+    }
+    LoRaSignalQuality_t* signalQuality = _findSignalQuality(radioId, false);
+    return (signalQuality != NULL) ? signalQuality->relayHops : 0;
+}
+
+uint32_t LoRaComm::_txFrequency(uint32_t radioId) {
+    if (m_channelCount == 0) {
+        return m_lora.getFrequency();   // only retuned with a channel plan
+    }
+    uint8_t channel = m_channel;
+    if (!m_isTerminal && m_loraExtraCount > 0 && radioId != LORACOMM_RADIOID_BROADCAST) {
+        channel = channelOf(radioId, m_channelCount);   // heard by one of the added LoRa devices, listening on its own channel
+    }
+    return m_channelFrequencies[channel];
+}
+
+LoRaTagStatistics_t* LoRaComm::_statsTagOf(uint8_t tagId) {
+    if (tagId >= LORACOMM_TAGID_RESERVED_MIN) {
+        return &m_statsTag[LORACOMM_STATS_TAG_COUNT+1+(tagId-LORACOMM_TAGID_RESERVED_MIN)];
+    }
+    if (tagId >= LORACOMM_STATS_TAG_COUNT) {
+        return &m_statsTag[LORACOMM_STATS_TAG_COUNT];   // shared
+    }
+    return &m_statsTag[tagId];
+}
+
+void LoRaComm::_headerEncode(LoRaSend_t* sendElement, size_t size) {
+    LoRaHeader_t* header = &sendElement->header;
+    uint8_t* encoded = sendElement->headerEncoded;
+    // 'header' keeps the tagId of the content
+    uint8_t tagId = sendElement->isEncrypted ? LORACOMM_TAGID_ENCRYPTED : (sendElement->isCompressed ? LORACOMM_TAGID_COMPRESSED : header->tagId);
+    if (sendElement->headerFormat == LORA_HEADER_V1) {
+        memcpy(encoded, header, sizeof(LoRaHeader_t));
+        encoded[offsetof(LoRaHeader_t, tagId)] = tagId;
+        sendElement->headerSize = sizeof(LoRaHeader_t);
+        return;
+    }
+
+    bool hasCrc16 = (sendElement->headerFormat == LORA_HEADER_V2_CRC16);
+    uint8_t offset = 0;
+    uint8_t version = (header->hops > 0) ? LORACOMM_HEADER_VERSION_2_RELAYED : LORACOMM_HEADER_VERSION_2;
+    encoded[offset++] = (version << 4) | (header->flags & LORACOMM_FLAG_MASK) | ((hasCrc16 ? 1:0) << LORACOMM_FLAG_IDX_HAS_CRC16);
+    encoded[offset++] = tagId;
+    if ((header->flags & (0x1 << LORACOMM_FLAG_IDX_REQUIRE_ACK)) != 0) {
+        encoded[offset++] = header->seq;
+    }
+    if (header->hops > 0) {
+        encoded[offset++] = header->hops;
+    }
+    uint32_t radioId = header->radioId;
+    while (radioId >= 0x80) {
+        encoded[offset++] = (radioId & 0x7F) | 0x80;
+        radioId >>= 7;
+    }
+    encoded[offset++] = radioId;
+    if (hasCrc16) {
+        uint16_t crc = calculateChecksum16(sendElement->payload, size, m_cryptoPhrase);
+        encoded[offset++] = crc & 0xFF;
+        encoded[offset++] = crc >> 8;
+    }
+    sendElement->headerSize = offset;
+}
+
+size_t LoRaComm::_headerDecode(const uint8_t* payload, size_t size, LoRaHeader_t* header, ELoRaHeaderFormat* format) {
+    // Header v1 has no version, try it first and recognize it by its checksum
+    if (size > sizeof(LoRaHeader_t)) {
+        memcpy(header, payload, sizeof(LoRaHeader_t));
+        if (header->checksum == calculateChecksum(payload+sizeof(LoRaHeader_t), size-sizeof(LoRaHeader_t), m_cryptoPhrase)) {
+            *format = LORA_HEADER_V1;
+            return sizeof(LoRaHeader_t);
+        }
+    }
+
+    uint8_t version = payload[0] >> 4;
+    if (size < 3 || (version != LORACOMM_HEADER_VERSION_2 && version != LORACOMM_HEADER_VERSION_2_RELAYED)) return 0;
+    bool hasCrc16 = (payload[0] & (0x1 << LORACOMM_FLAG_IDX_HAS_CRC16)) != 0;
+    header->flags = payload[0] & LORACOMM_FLAG_MASK;
+    header->tagId = payload[1];
+    header->hops = 0;
+    header->seq = 0;
+    size_t offset = 2;
+    if ((header->flags & (0x1 << LORACOMM_FLAG_IDX_REQUIRE_ACK)) != 0) {
+        header->seq = payload[offset++];
+    }
+    if (version == LORACOMM_HEADER_VERSION_2_RELAYED) {
+        if (offset >= size) return 0;
+        header->hops = payload[offset++];
+    }
+    uint32_t radioId = 0;
+    for (uint8_t shift=0; ; shift+=7) {
+        if (offset >= size || shift > 28) return 0;
+        uint8_t byte = payload[offset++];
+        radioId |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    header->radioId = radioId;
+    if (hasCrc16) {
+        if (offset+2 > size) return 0;
+        uint16_t crc = payload[offset] | (payload[offset+1] << 8);
+        offset += 2;
+        if (crc != calculateChecksum16(payload+offset, size-offset, m_cryptoPhrase)) return 0;
+    }
+    if (offset >= size) return 0;   // must contain at least 1 byte of usable payload
+    if (!hasCrc16 && !m_headerUnchecked && !(m_cryptoEnabled && header->tagId == LORACOMM_TAGID_ENCRYPTED)) {
+        return 0;   // nothing checks it, a v1 payload with a corrupted checksum can look like one
+    }
+
+    if (header->tagId == LORACOMM_TAGID_ENCRYPTED && size-offset >= LORACOMM_CRYPTO_OVERHEAD) {
+        memcpy(&header->checksum, payload+size-LORACOMM_CRYPTO_MIC_SIZE, sizeof(header->checksum));
+    }
+    else {
+        header->checksum = calculateChecksum(payload+offset, size-offset, m_cryptoPhrase);
+    }
+    *format = hasCrc16 ? LORA_HEADER_V2_CRC16 : LORA_HEADER_V2;
+    return offset;
+}
+
+void LoRaComm::_updateSignalQuality(uint32_t radioId, size_t size, int rssi, float snr, uint8_t hops) {
+    if (m_isTerminal) {
+        if (hops > 0) {
+            m_relayRxHops = hops;
+            m_relayRxAt = getMillis();
+        }
+        else if (m_relayRxHops != 0 && (getMillis() - m_relayRxAt) > LORACOMM_RELAY_DEDUP_WINDOW) {
+            m_relayRxHops = 0;  // Gateway in reach again
+        }
+        return; // I am not a Gateway, so ignore all signal quality logic
+    }
+
+    LoRaSignalQuality_t* signalQuality = _findSignalQuality(radioId, true);
+    if (signalQuality->lastUpdateAt == 0 || signalQuality->radioId != radioId) {
+        // New or replacing the least recently updated
+        signalQuality->radioId = radioId;
+        signalQuality->packets = 0;
+        signalQuality->spreadingFactor = 0;
+        signalQuality->spreadingFactorPending = 0;
+        signalQuality->relayHops = 0;
+        signalQuality->relayedAt = 0;
+        memset(&signalQuality->stats, 0, sizeof(signalQuality->stats));
+    }
+    signalQuality->lastUpdateAt = getMillis();
+    signalQuality->stats.bytesReceived += size;
+    if (hops > 0) {
+        signalQuality->relayHops = hops;
+        signalQuality->relayedAt = signalQuality->lastUpdateAt;
+        return; // Signal of the last relay, not of this radioId
+    }
+    if (signalQuality->relayHops != 0 && (signalQuality->lastUpdateAt - signalQuality->relayedAt) > LORACOMM_RELAY_DEDUP_WINDOW) {
+        // Received directly and no copy through relays for a while, in reach again.
+        // Within the window it may be the direct copy of a relayed payload, keep the hops so the relayed one is dropped.
+        signalQuality->relayHops = 0;
+    }
+
+    if (signalQuality->packets == 0) {
+        // Start the averages from this sample
+        signalQuality->rssiAvg = rssi;
+        signalQuality->snrAvg  = snr;
+    }
+    else {
+        signalQuality->rssiAvg += LORACOMM_SIGNAL_QUALITY_EWMA_ALPHA * (rssi - signalQuality->rssiAvg);
+        signalQuality->snrAvg  += LORACOMM_SIGNAL_QUALITY_EWMA_ALPHA * (snr  - signalQuality->snrAvg);
+    }
+    ++signalQuality->packets;
+    signalQuality->rssi = rssi;
+    signalQuality->snr  = snr;
+}
+
+LoRaSignalQuality_t* LoRaComm::_findSignalQuality(uint32_t radioId, bool insert) {
+    const uint32_t mask = LORACOMM_SIGNAL_QUALITY_COUNT_MAX-1;
+    const uint8_t bits = __builtin_ctz(LORACOMM_SIGNAL_QUALITY_COUNT_MAX);
+    uint32_t idx = (bits == 0) ? 0 : ((radioId * 2654435761u) >> (32 - bits));  // Knuth multiplicative hash, only the upper bits depend on every bit of radioId
+    LoRaSignalQuality_t* oldest = &m_signalQuality[idx];
+
+    for (int i=0; i<LORACOMM_SIGNAL_QUALITY_PROBE_MAX; ++i) {
+        LoRaSignalQuality_t* signalQuality = &m_signalQuality[(idx+i) & mask];
+        if (signalQuality->lastUpdateAt == 0) {
+            return insert ? signalQuality : NULL;   // elements are never removed, so radioId is not further ahead
+        }
+        if (signalQuality->radioId == radioId) {
+            return signalQuality;
+        }
+        if (signalQuality->lastUpdateAt < oldest->lastUpdateAt) {
+            oldest = signalQuality;
+        }
+    }
+    return insert ? oldest : NULL;
+}
+
+LoRaSend_t* LoRaComm::_queueSendReserve(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, ELoRaPriority priority) {
+    LoRaSend_t* sendElement = NULL;
+    int freeCount = 0;
+    for (int i=0; i<LORACOMM_SEND_QUEUE_MAX; ++i) {
+        if (m_sendQueue[i].payloadSize == 0 && !m_sendQueue[i].isReserved) {
+            if (sendElement == NULL) sendElement = &m_sendQueue[i];
+            ++freeCount;
+        }
+    }
+
+    if (sendElement == NULL || (!isAck && freeCount <= LORACOMM_SEND_QUEUE_ACK_RESERVED)) {
+        ++_statsTagOf(tagId)->queueFull;
+        LOG_D(PINICORE_TAG_LORACOMM, "Send queue is full");
+        return NULL; // queue currently full
+    }
+
+    sendElement->isReserved  = true;
+    sendElement->isEncrypted = false;
+    sendElement->isCompressed = false;
+    sendElement->priority    = isAck ? LORA_PRIORITY_ACK : priority;
+    sendElement->requiresACK = requireAck;
+    sendElement->retryCount  = 0;
+    sendElement->header.radioId = radioId;
+    sendElement->header.flags =
+        ((m_isTerminal ? 1:0) << LORACOMM_FLAG_IDX_IS_TERMINAL) |
+        ((requireAck   ? 1:0) << LORACOMM_FLAG_IDX_REQUIRE_ACK) |
+        ((isAck        ? 1:0) << LORACOMM_FLAG_IDX_IS_ACK);
+    sendElement->header.tagId = tagId;
+    sendElement->header.hops  = 0;
+    sendElement->header.seq   = 0;
+    sendElement->headerFormat = m_headerFormat;
+    return sendElement;
+}
+
+bool LoRaComm::_queueSendCommit(LoRaSend_t* sendElement, uint64_t delay, size_t size) {
+    if (size > LORACOMM_SEND_PAYLOAD_MAX) {
+        LOG_D(PINICORE_TAG_LORACOMM, "Unable to queue payload for send, invalid payload size %d", size);
+        sendElement->isReserved = false;
+        return false;
+    }
+
+    if (m_compressEnabled) {
+        size = _compress(sendElement, size);
+    }
+    if (m_cryptoEnabled && sendElement->header.radioId != LORACOMM_RADIOID_BROADCAST) {
+        size = _encrypt(sendElement, size);
+        if (size == 0) {
+            sendElement->isReserved = false;
+            return false;
+        }
+    }
+
+    if (sendElement->requiresACK) {
+        m_seq = (m_seq == UINT8_MAX) ? 1 : m_seq+1;   // 0 is no seq, the one of older firmware
+        sendElement->header.seq = m_seq;
+    }
+    if (sendElement->isEncrypted && sendElement->headerFormat != LORA_HEADER_V1) {
+        memcpy(&sendElement->header.checksum, sendElement->payload+size-LORACOMM_CRYPTO_MIC_SIZE, sizeof(sendElement->header.checksum));
+    }
+    else {
+        sendElement->header.checksum = calculateChecksum(sendElement->payload, size, m_cryptoPhrase);
+    }
+    return _queueSendEnqueue(sendElement, delay, size);
+}
+
+bool LoRaComm::_queueSendEnqueue(LoRaSend_t* sendElement, uint64_t delay, size_t size) {
+    _headerEncode(sendElement, size);
+    size_t sizeFull = sendElement->headerSize+size;
+    if (m_dutyCycle.getWaitTime(_txFrequency(sendElement->header.radioId), m_lora.timeOnAir(sizeFull)) == LORA_DUTYCYCLE_NEVER) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Send payload airtime larger than the duty cycle budget (%d bytes)", sizeFull);
+        sendElement->isReserved = false;
+        return false;
+    }
+
+    sendElement->queuedAt    = getMillis();
+    sendElement->nextRetryAt = sendElement->queuedAt + delay;
+    sendElement->payloadSize = sizeFull;
+    sendElement->isReserved  = false;
+    m_sendQueueMask[sendElement->priority] |= (0x1UL << (sendElement - m_sendQueue));
+    LOG_D(PINICORE_TAG_LORACOMM, "Added to send queue: [payloadSize: %d] [requiresACK: %d] [nextRetryAt: %llu]", sizeFull, sendElement->requiresACK, sendElement->nextRetryAt);
+    return true; // payload queued for send
+}
+
+bool LoRaComm::_queueSendHas(uint32_t radioId, uint8_t tagId) {
+    for (int i=0; i<LORACOMM_SEND_QUEUE_MAX; ++i) {
+        LoRaSend_t* sendElement = &m_sendQueue[i];
+        if (sendElement->payloadSize != 0 && sendElement->header.radioId == radioId && sendElement->header.tagId == tagId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+LoRaSend_t* LoRaComm::_queueSendFromPayload(uint8_t* payload) {
+    uintptr_t offset = (uintptr_t)payload - (uintptr_t)m_sendQueue;
+    if (payload == NULL || offset >= sizeof(m_sendQueue)) return NULL;
+
+    LoRaSend_t* sendElement = &m_sendQueue[offset / sizeof(LoRaSend_t)];
+    if (sendElement->payload != payload || !sendElement->isReserved) return NULL;
+    return sendElement;
+}
+
+void LoRaComm::_queueSendRemove(LoRaSend_t* sendElement) {
+    if (sendElement == NULL) return;
+    sendElement->payloadSize = 0;
+    m_sendQueueMask[sendElement->priority] &= ~(0x1UL << (sendElement - m_sendQueue));
+}
+
+LoRaSend_t* LoRaComm::_queueSendGetReady() {
+    uint64_t currMillis = getMillis();
+    for (int priority=0; priority<LORA_PRIORITY_COUNT; ++priority) {
+        uint32_t mask = m_sendQueueMask[priority];
+        while (mask != 0) {
+            LoRaSend_t* sendElement = &m_sendQueue[__builtin_ctz(mask)];
+            if (sendElement->nextRetryAt <= currMillis) {
+                return sendElement;
+            }
+            mask &= mask - 1;   // next queued element of this priority
+        }
+    }
+    return NULL;
+}
+
+bool LoRaComm::_queueSendAck(uint32_t radioId, uint32_t checksum) {
+    for (int i=0; i<LORACOMM_SEND_QUEUE_MAX; ++i) {
+        LoRaSend_t* sendElement = &m_sendQueue[i];
+        if (sendElement->payloadSize == 0 || !sendElement->requiresACK) {
+            continue;
+        }
+        LoRaHeader_t* header = &sendElement->header;
+        if (header->radioId == radioId && header->checksum == checksum) {
+            uint64_t latency = getMillis() - sendElement->lastSentAt;
+            statsAckLatency(m_statsAckLatency, latency);
+            LoRaSignalQuality_t* peer = m_isTerminal ? NULL : _findSignalQuality(radioId, false);
+            if (peer != NULL) {
+                statsAckLatency(peer->stats.ackLatency, latency);
+            }
+            if (header->tagId == LORACOMM_TAGID_ADR) {
+                LoRaSignalQuality_t* signalQuality = _findSignalQuality(radioId, false);
+                if (signalQuality != NULL && signalQuality->spreadingFactorPending != 0) {
+                    signalQuality->spreadingFactor = signalQuality->spreadingFactorPending;   // content may be encrypted
+                    signalQuality->spreadingFactorPending = 0;
+                    LOG_D(PINICORE_TAG_LORACOMM, "ADR assigned: [radioId: %d] [sf: %d]", radioId, signalQuality->spreadingFactor);
+                }
+            }
+            _queueSendRemove(sendElement);
+            return true;
+        }
+    }
+    return false;
+}
+
+void LoRaComm::_queueSendProcess() {
+    if (!isEnabled() || m_lora.isTransmitting()) return;
+
+    LoRaSend_t* sendElement = _queueSendGetReady();
+    if (sendElement == NULL) return;
+
+    LoRaHeader_t* header = &sendElement->header;
+    if (sendElement->requiresACK && sendElement->retryCount > LORACOMM_SEND_RETRY_MAX) {
+        LOG_D(PINICORE_TAG_LORACOMM, "Dropped from send queue, no ACK received: [radioId: %d] [tagId: %d] [checksum: 0x%x]", header->radioId, header->tagId, header->checksum);
+        ++_statsTagOf(header->tagId)->dropped;
+        LoRaSignalQuality_t* signalQuality = m_isTerminal ? NULL : _findSignalQuality(header->radioId, false);
+        if (signalQuality != NULL) {
+            ++signalQuality->stats.dropped;
+            // Terminal may no longer be on the assigned spreading factor, go back to the default as it will also do
+            signalQuality->spreadingFactor = 0;
+            signalQuality->spreadingFactorPending = 0;
+        }
+        _queueSendRemove(sendElement);
+        return;
+    }
+    if (sendElement->priority == LORA_PRIORITY_ACK && (getMillis() - sendElement->queuedAt) > LORACOMM_SEND_RETRY_TIMEOUT) {
+        // Sender already retried, its payload is ACKed again when received, sending this one only adds traffic
+        LOG_D(PINICORE_TAG_LORACOMM, "Dropped from send queue, ACK not sent in time: [radioId: %d] [tagId: %d]", header->radioId, header->tagId);
+        _queueSendRemove(sendElement);
+        return;
+    }
+
+    uint8_t sf    = m_lora.getSpreadingFactor();
+    uint8_t power = m_lora.getTxPower();
+    if (m_adrRxSpreadingFactor != 0) {
+        sf = m_adrTxSpreadingFactor;    // Terminal: send on the Gateway spreading factor
+    }
+    else if (!m_isTerminal && m_adrEnabled) {
+        _adrSelect(header->radioId, &sf, &power);
+    }
+    if (!m_isTerminal && header->tagId == LORACOMM_TAGID_ADR && (sendElement->retryCount % 2) == 1) {
+        // Terminal switches as soon as it receives the assignment, if only its ACK was lost it is already listening on the new one
+        LoRaSignalQuality_t* signalQuality = _findSignalQuality(header->radioId, false);
+        if (signalQuality != NULL && signalQuality->spreadingFactorPending != 0) {
+            sf = signalQuality->spreadingFactorPending;
+            power = m_lora.getTxPower();    // power was lowered for the current one
+        }
+    }
+
+    uint32_t frequency = _txFrequency(header->radioId);
+    uint32_t airtime = m_lora.timeOnAir(sendElement->payloadSize, sf);
+    uint32_t wait = m_dutyCycle.getWaitTime(frequency, airtime);
+    if (wait != 0) {
+        sendElement->nextRetryAt = getMillis() + wait;  // deferred, does not count as a retry
+        LOG_T(PINICORE_TAG_LORACOMM, "Deferred by duty cycle: [radioId: %d] [tagId: %d] [wait: %d]", header->radioId, header->tagId, wait);
+        return;
+    }
+    wait = _rxScheduleGetWaitTime(header->radioId, airtime);
+    if (wait != 0) {
+        sendElement->nextRetryAt = getMillis() + wait;  // deferred, does not count as a retry
+        LOG_T(PINICORE_TAG_LORACOMM, "Deferred to receive window: [radioId: %d] [tagId: %d] [wait: %d]", header->radioId, header->tagId, wait);
+        return;
+    }
+    wait = (sendElement->priority == LORA_PRIORITY_ACK) ? 0 : _tdmaGetWaitTime(airtime);   // ACKs answer the Gateway inside its own transmission slot
+    if (wait != 0) {
+        sendElement->nextRetryAt = getMillis() + wait;  // deferred, does not count as a retry
+        LOG_T(PINICORE_TAG_LORACOMM, "Deferred to slot: [radioId: %d] [tagId: %d] [wait: %d]", header->radioId, header->tagId, wait);
+        return;
+    }
+    if (frequency != m_lora.getFrequency() && !m_lora.setFrequency(frequency)) return;  // channel of the Terminal, back on TX done
+    if (m_lbtEnabled) {
+        bool detected;
+        if (!m_lora.getCadResult(&detected)) {
+            m_lora.startCad();  // result on a next call, unless one is already running
+            return;
+        }
+        if (detected) {
+            m_lora.setFrequency(_txFrequency(LORACOMM_RADIOID_BROADCAST));  // not sending, keep listening on our own channel
+            sendElement->nextRetryAt = getMillis() + random(LORACOMM_LBT_BACKOFF_MIN, LORACOMM_LBT_BACKOFF_MAX);  // does not count as a retry
+            LOG_T(PINICORE_TAG_LORACOMM, "Deferred by channel activity: [radioId: %d] [tagId: %d]", header->radioId, header->tagId);
+            return;
+        }
+    }
+
+    if (!m_lora.send(sendElement->headerEncoded, sendElement->headerSize, sendElement->payload, sendElement->payloadSize-sendElement->headerSize, sf, power)) return;  // busy, try again on next call
+    m_dutyCycle.consume(frequency, airtime);
+    sendElement->lastSentAt = getMillis();
+    LoRaTagStatistics_t* tagStats = _statsTagOf(header->tagId);
+    ++tagStats->packetsSent;
+    tagStats->bytesSent += sendElement->payloadSize;
+    tagStats->airtime   += airtime / 1000;
+    tagStats->retries   += (sendElement->retryCount > 0) ? 1 : 0;
+    LoRaSignalQuality_t* peer = m_isTerminal ? NULL : _findSignalQuality(header->radioId, false);
+    if (peer != NULL) {
+        ++peer->stats.packetsSent;
+        peer->stats.bytesSent += sendElement->payloadSize;
+        peer->stats.airtime   += airtime / 1000;
+        peer->stats.retries   += (sendElement->retryCount > 0) ? 1 : 0;
+    }
+    if (!sendElement->requiresACK) {
+        _queueSendRemove(sendElement);
+        return;
+    }
+
+    // Wait for this payload and the ACK reply to be on air before counting the timeout
+    uint32_t airtimeAck = m_lora.timeOnAir(sendElement->headerSize+sizeof(uint32_t));
+    uint64_t timeout = ((uint64_t)LORACOMM_SEND_RETRY_TIMEOUT) << sendElement->retryCount;  // exponential backoff
+    timeout *= 1 + _relayHops(header->radioId);   // each relay forwards the payload and the ACK
+    ++sendElement->retryCount;
+    sendElement->nextRetryAt = getMillis() + ((airtime + airtimeAck) / 1000) + timeout + random(0, LORACOMM_SEND_RETRY_JITTER);
+    LOG_T(PINICORE_TAG_LORACOMM, "Sent waiting for ACK: [radioId: %d] [tagId: %d] [retryCount: %d] [nextRetryAt: %llu]", header->radioId, header->tagId, sendElement->retryCount, sendElement->nextRetryAt);
+}
+
+bool LoRaComm::_fragmentSend(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, ELoRaPriority priority) {
+    if (size > LORACOMM_MESSAGE_SIZE_MAX) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Send payload too large (%d bytes), max %d bytes", size, LORACOMM_MESSAGE_SIZE_MAX);
+        return false;
+    }
+
+    for (int i=0; i<LORACOMM_FRAGMENT_TX_POOL_SIZE; ++i) {
+        LoRaFragmentTx_t* fragmentTx = &m_fragmentTx[i];
+        if (fragmentTx->count != 0) continue;
+
+        fragmentTx->radioId     = radioId;
+        fragmentTx->tagId       = tagId;
+        fragmentTx->messageId   = m_fragmentMessageId++;
+        fragmentTx->count       = (size + LORACOMM_FRAGMENT_DATA_MAX - 1) / LORACOMM_FRAGMENT_DATA_MAX;
+        fragmentTx->retryCount  = 0;
+        fragmentTx->priority    = priority;
+        fragmentTx->acked       = 0;
+        fragmentTx->pending     = (fragmentTx->count == 32) ? UINT32_MAX : ((1UL << fragmentTx->count) - 1);
+        fragmentTx->nextRetryAt = 0;
+        fragmentTx->size        = size;
+        memcpy(fragmentTx->payload, payload, size);
+        LOG_D(PINICORE_TAG_LORACOMM, "Sending fragmented: [radioId: %d] [tagId: %d] [messageId: %d] [count: %d]", radioId, tagId, fragmentTx->messageId, fragmentTx->count);
+        return true;
+    }
+
+    LOG_D(PINICORE_TAG_LORACOMM, "Fragment send pool is full");
+    return false;
+}
+
+void LoRaComm::_fragmentProcess() {
+    uint64_t currMillis = getMillis();
+
+    for (int i=0; i<LORACOMM_FRAGMENT_TX_POOL_SIZE; ++i) {
+        LoRaFragmentTx_t* fragmentTx = &m_fragmentTx[i];
+        if (fragmentTx->count == 0) continue;
+
+        if (fragmentTx->pending == 0) {
+            if (fragmentTx->nextRetryAt == 0) {
+                // Count the timeout only once every fragment left the send queue, time deferred by duty cycle or slot does not use it up
+                if (_queueSendHas(fragmentTx->radioId, LORACOMM_TAGID_FRAGMENT)) continue;
+                uint32_t airtime = getTimeOnAir(LORACOMM_SEND_PAYLOAD_MAX) + getTimeOnAir(sizeof(LoRaFragmentAck_t));   // last fragment still on air and the reply
+                fragmentTx->nextRetryAt = currMillis + (airtime / 1000) + LORACOMM_SEND_RETRY_TIMEOUT + random(0, LORACOMM_SEND_RETRY_JITTER);
+                continue;
+            }
+            if (currMillis < fragmentTx->nextRetryAt) continue;
+            if (++fragmentTx->retryCount > LORACOMM_SEND_RETRY_MAX) {
+                LOG_D(PINICORE_TAG_LORACOMM, "Dropped fragmented, no ACK received: [radioId: %d] [messageId: %d]", fragmentTx->radioId, fragmentTx->messageId);
+                fragmentTx->count = 0;
+                continue;
+            }
+            fragmentTx->pending = 0x1UL << (fragmentTx->count-1);   // the last fragment makes the receiver reply with its bitmap
+        }
+
+        // Queue as many pending fragments as the send queue takes, the rest goes on next call
+        while (fragmentTx->pending != 0) {
+            LoRaSend_t* sendElement = _queueSendReserve(fragmentTx->radioId, LORACOMM_TAGID_FRAGMENT, false, false, fragmentTx->priority);
+            if (sendElement == NULL) break;
+
+            uint8_t index = __builtin_ctz(fragmentTx->pending);
+            size_t offset = index * LORACOMM_FRAGMENT_DATA_MAX;
+            size_t size = fragmentTx->size - offset;
+            if (size > LORACOMM_FRAGMENT_DATA_MAX) {
+                size = LORACOMM_FRAGMENT_DATA_MAX;
+            }
+            LoRaFragmentHeader_t* header = (LoRaFragmentHeader_t*)sendElement->payload;
+            header->tagId     = fragmentTx->tagId;
+            header->messageId = fragmentTx->messageId;
+            header->index     = index;
+            header->count     = fragmentTx->count;
+            memcpy(sendElement->payload+sizeof(LoRaFragmentHeader_t), fragmentTx->payload+offset, size);
+            if (!_queueSendCommit(sendElement, 0, sizeof(LoRaFragmentHeader_t)+size)) {
+                break;
+            }
+            fragmentTx->pending &= ~(0x1UL << index);
+            if (fragmentTx->pending == 0) {
+                fragmentTx->nextRetryAt = 0;    // timeout starts when sent, see above
+            }
+        }
+    }
+
+    for (int i=0; i<LORACOMM_FRAGMENT_RX_POOL_SIZE; ++i) {
+        LoRaFragmentRx_t* fragmentRx = &m_fragmentRx[i];
+        if (fragmentRx->count != 0 && (currMillis - fragmentRx->lastUpdateAt) > LORACOMM_FRAGMENT_RX_TIMEOUT) {
+            if (!fragmentRx->completed) {
+                LOG_D(PINICORE_TAG_LORACOMM, "Discarded incomplete fragmented: [radioId: %d] [messageId: %d]", fragmentRx->radioId, fragmentRx->messageId);
+            }
+            fragmentRx->count = 0;
+        }
+    }
+}
+
+void LoRaComm::_fragmentOnReceive(uint32_t radioId, const uint8_t* content, size_t size, int rssi, float snr) {
+    if (size <= sizeof(LoRaFragmentHeader_t)) return;
+    const LoRaFragmentHeader_t* header = (const LoRaFragmentHeader_t*)content;
+    const uint8_t* data = content+sizeof(LoRaFragmentHeader_t);
+    size_t dataSize = size-sizeof(LoRaFragmentHeader_t);
+    size_t offset = header->index * LORACOMM_FRAGMENT_DATA_MAX;
+    bool isLast = (header->index == header->count-1);
+    if (
+        header->count == 0 || header->count > LORACOMM_FRAGMENT_COUNT_MAX || header->index >= header->count ||
+        dataSize > LORACOMM_FRAGMENT_DATA_MAX || (!isLast && dataSize != LORACOMM_FRAGMENT_DATA_MAX) || offset+dataSize > LORACOMM_MESSAGE_SIZE_MAX
+    ) {
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Received invalid fragment: [radioId: %d] [index: %d] [count: %d]", radioId, header->index, header->count);
+        return;
+    }
+
+    // Find the reassembly of this payload, or a free / the oldest element for it
+    LoRaFragmentRx_t* fragmentRx = NULL;
+    LoRaFragmentRx_t* oldest = &m_fragmentRx[0];
+    for (int i=0; i<LORACOMM_FRAGMENT_RX_POOL_SIZE; ++i) {
+        LoRaFragmentRx_t* element = &m_fragmentRx[i];
+        if (element->count != 0 && element->radioId == radioId && element->messageId == header->messageId) {
+            fragmentRx = element;
+            break;
+        }
+        if (element->count == 0 || (oldest->count != 0 && element->lastUpdateAt < oldest->lastUpdateAt)) {
+            oldest = element;
+        }
+    }
+    if (fragmentRx != NULL) {
+        // Same messageId but another payload, the sender rebooted or its messageId wrapped, start again instead of ACKing the old one
+        bool isOther = (fragmentRx->count != header->count || fragmentRx->tagId != header->tagId);
+        if (!isOther && (fragmentRx->received & (0x1UL << header->index)) != 0) {
+            isOther = memcmp(fragmentRx->payload+offset, data, dataSize) != 0 || (isLast && fragmentRx->size != offset+dataSize);
+        }
+        if (isOther) {
+            LOG_D(PINICORE_TAG_LORACOMM_CB, "Fragmented reusing a messageId, started again: [radioId: %d] [messageId: %d]", radioId, header->messageId);
+            oldest = fragmentRx;
+            fragmentRx = NULL;
+        }
+    }
+    if (fragmentRx == NULL) {
+        fragmentRx = oldest;
+        fragmentRx->radioId     = radioId;
+        fragmentRx->tagId       = header->tagId;
+        fragmentRx->messageId   = header->messageId;
+        fragmentRx->count       = header->count;
+        fragmentRx->completed   = false;
+        fragmentRx->received    = 0;
+        fragmentRx->size        = 0;
+    }
+    fragmentRx->lastUpdateAt = getMillis();
+
+    if (!fragmentRx->completed) {
+        memcpy(fragmentRx->payload+offset, data, dataSize);
+        fragmentRx->received |= 0x1UL << header->index;
+        if (isLast) {
+            fragmentRx->size = offset+dataSize;     // only the last fragment tells the total size
+        }
+    }
+
+    uint32_t all = (fragmentRx->count == 32) ? UINT32_MAX : ((1UL << fragmentRx->count) - 1);
+    bool completed = !fragmentRx->completed && fragmentRx->received == all;
+    if (completed || isLast) {
+        LoRaFragmentAck_t ack;
+        ack.messageId = fragmentRx->messageId;
+        ack.received  = fragmentRx->received;
+        _send(radioId, LORACOMM_TAGID_FRAGMENT_ACK, false, false, (uint8_t*)&ack, sizeof(ack), LORA_PRIORITY_CONTROL);
+    }
+    if (completed) {
+        fragmentRx->completed = true;
+        LOG_D(PINICORE_TAG_LORACOMM_CB, "Reassembled: [radioId: %d] [tagId: %d] [size: %d]", radioId, fragmentRx->tagId, fragmentRx->size);
+        _dispatch(radioId, fragmentRx->tagId, fragmentRx->payload, fragmentRx->size, rssi, snr);
+    }
+}
+
+void LoRaComm::_fragmentOnAck(uint32_t radioId, const uint8_t* content, size_t size) {
+    if (size < sizeof(LoRaFragmentAck_t)) return;
+    LoRaFragmentAck_t ack;
+    memcpy(&ack, content, sizeof(ack));
+
+    for (int i=0; i<LORACOMM_FRAGMENT_TX_POOL_SIZE; ++i) {
+        LoRaFragmentTx_t* fragmentTx = &m_fragmentTx[i];
+        if (fragmentTx->count == 0 || fragmentTx->radioId != radioId || fragmentTx->messageId != ack.messageId) continue;
+
+        uint32_t all = (fragmentTx->count == 32) ? UINT32_MAX : ((1UL << fragmentTx->count) - 1);
+        fragmentTx->acked |= ack.received & all;
+        if (fragmentTx->acked == all) {
+            LOG_D(PINICORE_TAG_LORACOMM_CB, "Fragmented ACK received: [radioId: %d] [messageId: %d]", radioId, ack.messageId);
+            fragmentTx->count = 0;
+            return;
+        }
+        if (fragmentTx->pending != 0) return;   // still sending the current round
+        if (++fragmentTx->retryCount > LORACOMM_SEND_RETRY_MAX) {
+            LOG_D(PINICORE_TAG_LORACOMM, "Dropped fragmented, fragments missing: [radioId: %d] [messageId: %d]", radioId, ack.messageId);
+            fragmentTx->count = 0;
+            return;
+        }
+        fragmentTx->pending = all & ~fragmentTx->acked;
+        LOG_T(PINICORE_TAG_LORACOMM_CB, "Fragments missing: [radioId: %d] [messageId: %d] [missing: 0x%x]", radioId, ack.messageId, fragmentTx->pending);
+        return;
+    }
+}
+
+bool LoRaComm::_aggregateAdd(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size) {
+    size_t sizeRecord = sizeof(LoRaAggregateRecord_t)+size;
+    LoRaAggregate_t* aggregate = NULL;
+    LoRaAggregate_t* aggregateFree = NULL;
+    for (int i=0; i<LORACOMM_AGGREGATE_POOL_SIZE; ++i) {
+        LoRaAggregate_t* current = &m_aggregate[i];
+        if (current->sendElement == NULL) {
+            if (aggregateFree == NULL) aggregateFree = current;
+        }
+        else if (current->sendElement->header.radioId == radioId) {
+            aggregate = current;
+            break;
+        }
+    }
+
+    if (aggregate != NULL && aggregate->size+sizeRecord > LORACOMM_SEND_PAYLOAD_MAX) {
+        _aggregateCommit(aggregate);    // does not fit, send what is there and start again
+        aggregateFree = aggregate;
+        aggregate = NULL;
+    }
+
+    // Only accept what is sure to be committed, the caller is told the payload was queued
+    size_t sizeTotal = ((aggregate != NULL) ? aggregate->size : 0) + sizeRecord + (m_cryptoEnabled ? LORACOMM_CRYPTO_OVERHEAD : 0);
+    if (m_dutyCycle.getWaitTime(_txFrequency(radioId), getTimeOnAir(sizeTotal)) == LORA_DUTYCYCLE_NEVER) {
+        LOG_W(PINICORE_TAG_LORACOMM, "Aggregated payload airtime larger than the duty cycle budget (%d bytes)", sizeTotal);
+        return false;
+    }
+
+    if (aggregate == NULL) {
+        if (aggregateFree == NULL) {
+            LOG_D(PINICORE_TAG_LORACOMM, "Aggregation pool is full");
+            return false;
+        }
+        LoRaSend_t* sendElement = _queueSendReserve(radioId, LORACOMM_TAGID_AGGREGATE, requireAck, false, LORA_PRIORITY_TELEMETRY);
+        if (sendElement == NULL) return false;
+        aggregate = aggregateFree;
+        aggregate->sendElement = sendElement;
+        aggregate->commitAt = getMillis() + m_aggregateWindow;
+        aggregate->size = 0;
+    }
+
+    LoRaSend_t* sendElement = aggregate->sendElement;
+    if (requireAck && !sendElement->requiresACK) {
+        sendElement->requiresACK = true;
+        sendElement->header.flags |= (0x1 << LORACOMM_FLAG_IDX_REQUIRE_ACK);
+    }
+    LoRaAggregateRecord_t* record = (LoRaAggregateRecord_t*)(sendElement->payload+aggregate->size);
+    record->tagId = tagId;
+    record->size  = size;
+    memcpy(sendElement->payload+aggregate->size+sizeof(LoRaAggregateRecord_t), payload, size);
+    aggregate->size += sizeRecord;
+    LOG_T(PINICORE_TAG_LORACOMM, "Aggregated: [radioId: %d] [tagId: %d] [size: %d] [total: %d]", radioId, tagId, size, aggregate->size);
+    return true;
+}
+
+bool LoRaComm::_aggregateCommit(LoRaAggregate_t* aggregate) {
+    LoRaSend_t* sendElement = aggregate->sendElement;
+    uint32_t radioId = sendElement->header.radioId;
+    aggregate->sendElement = NULL;
+    if (!_queueSendCommit(sendElement, 0, aggregate->size)) {
+        ++_statsTagOf(LORACOMM_TAGID_AGGREGATE)->dropped;
+        LOG_W(PINICORE_TAG_LORACOMM, "Aggregated payload dropped, unable to queue for send: [radioId: %d] [size: %d]", radioId, aggregate->size);
+        return false;
+    }
+    return true;
+}
+
+void LoRaComm::_aggregateProcess() {
+    uint64_t currMillis = getMillis();
+    for (int i=0; i<LORACOMM_AGGREGATE_POOL_SIZE; ++i) {
+        LoRaAggregate_t* aggregate = &m_aggregate[i];
+        if (aggregate->sendElement != NULL && currMillis >= aggregate->commitAt) {
+            _aggregateCommit(aggregate);
+        }
+    }
+}
+
+void LoRaComm::_aggregateOnReceive(uint32_t radioId, const uint8_t* content, size_t size, int rssi, float snr) {
+    size_t offset = 0;
+    while (offset+sizeof(LoRaAggregateRecord_t) <= size) {
+        const LoRaAggregateRecord_t* record = (const LoRaAggregateRecord_t*)(content+offset);
+        offset += sizeof(LoRaAggregateRecord_t);
+        if (offset+record->size > size) {
+            LOG_T(PINICORE_TAG_LORACOMM_CB, "Aggregated record truncated: [radioId: %d] [tagId: %d] [size: %d]", radioId, record->tagId, record->size);
+            return;
+        }
+        if (record->tagId < LORACOMM_TAGID_RESERVED_MIN) {
+            _dispatch(radioId, record->tagId, content+offset, record->size, rssi, snr);
+        }
+        offset += record->size;
+    }
+}
+
+void LoRaComm::_adrSelect(uint32_t radioId, uint8_t* sf, uint8_t* power) {
+    LoRaSignalQuality_t* signalQuality = _findSignalQuality(radioId, false);
+    if (signalQuality == NULL || signalQuality->packets < LORACOMM_ADR_PACKETS_MIN) return;
+    if (signalQuality->relayHops != 0) return;  // Terminal receives through a relay, on the spreading factor of the relay
+
+    float snr = signalQuality->snrAvg;
+    uint8_t sfDefault = *sf;
+    uint8_t current = (signalQuality->spreadingFactor != 0) ? signalQuality->spreadingFactor : sfDefault;
+
+    // Lower the transmit power by the SNR left over the margin, 1dB per dB
+    float excess = snr - adrSnrFloor(current) - LORACOMM_ADR_MARGIN;
+    if (excess >= 1.0f) {
+        int reduced = *power - (int)excess;
+        *power = (reduced < LORACOMM_ADR_TX_POWER_MIN) ? LORACOMM_ADR_TX_POWER_MIN : reduced;
+    }
+    *sf = current;
+
+    if (signalQuality->spreadingFactorPending != 0) return;    // wait for the Terminal to ACK the previous assignment
+
+    // Lowest spreading factor with enough margin
+    uint8_t target = 12;
+    if (m_tdmaBeaconAt != 0) {
+        target = sfDefault;     // beacons are sent on the default one, Terminals must keep receiving them
+    }
+    else {
+        for (uint8_t candidate=LORACOMM_ADR_SF_MIN; candidate<12; ++candidate) {
+            float margin = LORACOMM_ADR_MARGIN + ((candidate < current) ? LORACOMM_ADR_HYSTERESIS : 0.0f);
+            if (snr - adrSnrFloor(candidate) >= margin) {
+                target = candidate;
+                break;
+            }
+        }
+    }
+    if (target == current) return;
+
+    if (_send(radioId, LORACOMM_TAGID_ADR, true, false, &target, sizeof(target), LORA_PRIORITY_CONTROL)) {
+        signalQuality->spreadingFactorPending = target;
+        LOG_D(PINICORE_TAG_LORACOMM, "ADR assigning: [radioId: %d] [sf: %d -> %d] [snr: %0.2f]", radioId, current, target, snr);
+    }
+}
+
+void LoRaComm::_adrSetRxSpreadingFactor(uint8_t sf) {
+    if (sf == 0) {
+        if (m_adrRxSpreadingFactor == 0) return;
+        m_adrRxSpreadingFactor = 0;
+        m_lora.setSpreadingFactor(m_adrTxSpreadingFactor);
+        return;
+    }
+
+    if (m_adrRxSpreadingFactor == 0) {
+        m_adrTxSpreadingFactor = m_lora.getSpreadingFactor();
+    }
+    m_adrRxSpreadingFactor = sf;
+    m_adrLastReceivedAt = getMillis();
+    m_lora.setSpreadingFactor(sf);
+    LOG_D(PINICORE_TAG_LORACOMM, "ADR receiving on [sf: %d], sending on [sf: %d]", sf, m_adrTxSpreadingFactor);
 }
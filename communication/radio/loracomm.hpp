@@ -17,33 +17,211 @@
 #define _PINICORE_LORACOMM_H_
 
 #include "drivers/communication/lora.hpp"
+#include "communication/radio/dutycycle.hpp"
+#include <mbedtls/ccm.h>
 
-#define LORACOMM_INVALID_TAGID      UINT8_MAX   // Reserved tagId that is used to identify that a 'onReceive' callback is not set for that index.
+#define LORACOMM_TAGID_COUNT        (UINT8_MAX+1)   // Number of possible tagIds.
+#ifndef LORACOMM_ONRECEIVE_SIZE_MAX
+    #define LORACOMM_ONRECEIVE_SIZE_MAX 32  // Maximum number of tagIds that can be "subscribed" at one time, up to 'LORACOMM_TAGID_RESERVED_MIN'. I want to avoid using 'malloc'.
+#endif
+#define LORACOMM_INVALID_TAGID      UINT8_MAX   // Reserved tagId, never delivered to an 'onReceive' callback. Kept for older code, it is now part of the reserved range.
 
-#define LORACOMM_ONRECEIVE_SIZE_MAX 16  // Maximum number of tagIds that can be "subscribed". I want to avoid using 'malloc'.
+/**
+ * TagIds [0xF0, 0xFF] are reserved for LoRaComm internal payloads, cannot be used with 'onReceive' or 'send'.
+ * Migrating from older firmware: only 'LORACOMM_INVALID_TAGID' was reserved before, payloads using any other tagId of this range
+ * must move to a tagId below it, on every controller at the same time. Older firmware delivers the internal payloads of newer
+ * controllers to the 'onReceive' of these tagIds, if registered.
+ * Received payloads with a reserved tagId not handled internally, also the one inside an encrypted or compressed payload,
+ * are dropped and counted in 'packetsInvalid', they never reach 'onReceiveAny' either.
+ */
+#define LORACOMM_TAGID_RESERVED_MIN 0xF0
+#define LORACOMM_TAGID_ADR          0xFF    // Gateway assigns to a Terminal the spreading factor to receive on. Content: uint8_t spreadingFactor.
+#define LORACOMM_TAGID_FRAGMENT     0xFE    // Fragment of a payload above 'LORACOMM_SEND_PAYLOAD_MAX'. Content: 'LoRaFragmentHeader_t' + fragment data.
+#define LORACOMM_TAGID_FRAGMENT_ACK 0xFD    // Fragments received of a payload. Content: 'LoRaFragmentAck_t'.
+#define LORACOMM_TAGID_AGGREGATE    0xFC    // Several small payloads to the same radioId. Content: 'LoRaAggregateRecord_t' + record data, repeated.
+#define LORACOMM_TAGID_BEACON       0xFB    // Gateway TDMA beacon, sent to 'LORACOMM_RADIOID_BROADCAST'. Content: 'LoRaBeacon_t'.
+#define LORACOMM_TAGID_ENCRYPTED    0xFA    // Payload encrypted with 'setEncryptionKey'. Content: uint32_t counter + encrypted (uint8_t tagId + payload) + MIC.
+#define LORACOMM_TAGID_COMPRESSED   0xF9    // Payload compressed with 'setCompression'. Content: uint8_t tagId + uint8_t dictionary check + 'compressLz' data.
+
+#define LORACOMM_RADIOID_BROADCAST  0xFFFFFFFF  // RadioId of payloads received by every Terminal, only used by internal payloads.
+
+#define LORACOMM_CRYPTO_KEY_SIZE    16  // AES-128 key size in bytes.
+#define LORACOMM_CRYPTO_MIC_SIZE    4   // Message integrity code size in bytes, appended to each encrypted payload.
+#define LORACOMM_CRYPTO_NONCE_SIZE  13  // CCM nonce size in bytes: radioId, direction, counter and zero padding.
+#define LORACOMM_CRYPTO_OVERHEAD    (sizeof(uint32_t)+1+LORACOMM_CRYPTO_MIC_SIZE)   // Bytes added to the content of an encrypted payload: counter, tagId and MIC.
+#define LORACOMM_CRYPTO_REPLAY_WINDOW 32    // Counters below the last received still accepted once, up to 32. Retries and priorities reorder payloads.
+#ifndef LORACOMM_CRYPTO_PEER_MAX
+    #define LORACOMM_CRYPTO_PEER_MAX 256    // Gateway: number of radioIds whose encryption counter is tracked, must be a power of 2. Never evicted, payloads from more are dropped.
+#endif
 
-#define LORACOMM_SEND_PAYLOAD_MAX   (LORA_PACKET_MAX_SIZE-sizeof(LoRaHeader_t))   // Maximum number of bytes that can be sent, excluding header.
-#define LORACOMM_SEND_QUEUE_MAX     16  // Maximum number of payloads that can be on the send queue at one time.
+#define LORACOMM_COMPRESS_OVERHEAD  2   // Bytes added to the content of a compressed payload: tagId and dictionary check.
+
+#define LORACOMM_SEND_PAYLOAD_MAX   (LORA_PACKET_MAX_SIZE-sizeof(LoRaHeader_t)-LORACOMM_CRYPTO_OVERHEAD)   // Maximum number of bytes that can be sent, excluding header, leaves room to encrypt.
+#ifndef LORACOMM_SEND_QUEUE_MAX
+    #define LORACOMM_SEND_QUEUE_MAX     16  // Maximum number of payloads that can be on the send queue at one time, up to 32.
+#endif
+#define LORACOMM_SEND_QUEUE_ACK_RESERVED 2  // Elements of the send queue only used by ACKs, so they are not lost when the queue is full.
 #define LORACOMM_SEND_RETRY_MAX     3   // Maximum number of retries before dropping if no ACK reply, when required.
+#define LORACOMM_SEND_RETRY_TIMEOUT 2000    // Time in millis to wait for an ACK before the first retry, doubled on every following retry.
+#define LORACOMM_SEND_RETRY_JITTER  500     // Maximum random time in millis added to each retry, so that 2 controllers do not retry in lockstep.
+
+#define LORACOMM_FRAGMENT_DATA_MAX      (LORACOMM_SEND_PAYLOAD_MAX-sizeof(LoRaFragmentHeader_t))    // Maximum number of payload bytes per fragment.
+#define LORACOMM_FRAGMENT_COUNT_MAX     32      // Maximum number of fragments per payload, one bit each in 'LoRaFragmentAck_t'.
+#ifndef LORACOMM_MESSAGE_SIZE_MAX
+    #define LORACOMM_MESSAGE_SIZE_MAX       2048    // Maximum number of bytes that can be sent, excluding header, when fragmented. Up to 'LORACOMM_FRAGMENT_COUNT_MAX' fragments.
+#endif
+#ifndef LORACOMM_FRAGMENT_TX_POOL_SIZE
+    #define LORACOMM_FRAGMENT_TX_POOL_SIZE  2       // Maximum number of fragmented payloads being sent at one time.
+#endif
+#ifndef LORACOMM_FRAGMENT_RX_POOL_SIZE
+    #define LORACOMM_FRAGMENT_RX_POOL_SIZE  2       // Maximum number of fragmented payloads being reassembled at one time.
+#endif
+#define LORACOMM_FRAGMENT_RX_TIMEOUT    60000   // Time in millis without new fragments after which a reassembly is discarded, also how long a completed one is kept to re-ACK.
+
+#define LORACOMM_TDMA_BEACON_GUARD  200     // Time in millis after the beacon before the first slot, leaves room for the Gateway downlinks.
+#define LORACOMM_TDMA_SLOT_GUARD    50      // Time in millis at the start of each slot without sending, covers clock drift and 'maintain' call latency.
+#define LORACOMM_TDMA_BEACON_LOST_MAX 3     // Terminal: periods without beacon after which it goes back to send at any time.
+
+#define LORACOMM_LBT_BACKOFF_MIN    20      // Minimum random time in millis to wait when the channel is busy before checking again.
+#define LORACOMM_LBT_BACKOFF_MAX    200     // Maximum random time in millis to wait when the channel is busy before checking again.
+
+#define LORACOMM_RX_SCHEDULE_GUARD  50      // Gateway: time in millis before the end of a Terminal receive window after which it does not send to it.
+#define LORACOMM_RX_SCHEDULE_POLL   1000    // Gateway: time in millis to check again, when a Terminal only listens after its next uplink.
+
+#define LORACOMM_CHANNEL_COUNT_MAX  16      // Maximum number of carrier frequencies in the channel plan.
+
+#define LORACOMM_RADIO_EXTRA_MAX    3       // Maximum number of receive only LoRa devices added to a Gateway, see 'addRadio'.
+
+#ifndef LORACOMM_TASK_STACK_SIZE
+    #define LORACOMM_TASK_STACK_SIZE    8192    // Stack size in bytes of the task started with 'startTask'.
+#endif
+#define LORACOMM_TASK_PRIORITY      5       // Default priority of the task started with 'startTask', above Arduino 'loop()' and below the LoRa radio task.
+#define LORACOMM_TASK_PERIOD        5       // Time in millis between runs of the task started with 'startTask'.
+#ifndef LORACOMM_DELIVERY_QUEUE_SIZE
+    #define LORACOMM_DELIVERY_QUEUE_SIZE 4      // Payloads received by the task started with 'startTask' that can wait for 'maintain' before start dropping, must be a power of 2.
+#endif
+
+#ifndef LORACOMM_DEDUP_CACHE_SIZE
+    #define LORACOMM_DEDUP_CACHE_SIZE   32      // Number of payloads requiring ACK remembered to detect when they are received again.
+#endif
+#define LORACOMM_DEDUP_WINDOW       30000   // Time in millis a payload is remembered by radioId, seq and checksum, longer than the sender keeps retrying it.
+
+#define LORACOMM_RELAY_ROUTE_MAX    16      // Maximum number of radioIds a relay forwards payloads for.
+#define LORACOMM_RELAY_HOPS_MAX     3       // Payloads already forwarded this many times are not forwarded again.
+#define LORACOMM_RELAY_DEDUP_WINDOW 5000    // Time in millis a forwarded payload is remembered, so copies from other relays are not forwarded or delivered again.
+
+#ifndef LORACOMM_AGGREGATE_POOL_SIZE
+    #define LORACOMM_AGGREGATE_POOL_SIZE    4       // Maximum number of destinations with payloads being aggregated at one time.
+#endif
+#define LORACOMM_AGGREGATE_RECORD_MAX   (LORACOMM_SEND_PAYLOAD_MAX-sizeof(LoRaAggregateRecord_t))   // Maximum number of bytes of a payload that can be aggregated.
+
+/**
+ * @brief   Send queue priority, payloads ready to be sent go in this order.
+ */
+enum ELoRaPriority : uint8_t {
+    LORA_PRIORITY_ACK,          // ACKs, internal only, must be sent before the sender retries.
+    LORA_PRIORITY_CONTROL,      // Commands, alarms and internal control payloads.
+    LORA_PRIORITY_TELEMETRY,    // Periodic and bulk data, the default.
+    LORA_PRIORITY_COUNT
+};
 
 //user callbacks
 typedef std::function<void(uint32_t radioId, const uint8_t* payload, size_t size, int rssi, float snr)> LoRaOnReceiveCallback;
+typedef std::function<void(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr)> LoRaOnReceiveAnyCallback;  // Catch-all for tagIds without callback
+
+#define LORACOMM_STATS_LATENCY_BUCKETS  8   // Buckets of the ACK round trip histograms.
+#define LORACOMM_STATS_LATENCY_MIN      64  // Upper limit in millis of the first bucket, each following one doubles it, the last has no upper limit.
+#ifndef LORACOMM_STATS_TAG_COUNT
+    #define LORACOMM_STATS_TAG_COUNT    LORACOMM_TAGID_RESERVED_MIN // TagIds below this one have their own statistics, the ones above up to 'LORACOMM_TAGID_RESERVED_MIN' share one.
+#endif
 
 typedef struct {
     uint32_t bytesSent;
     uint32_t bytesReceived;
     uint32_t packetsSent;
     uint32_t packetsReceived;
+    uint32_t packetsDropped;    // Received but dropped because the receive ring was full.
+    uint32_t packetsDuplicated; // Received again because the ACK was lost, ACKed again but not delivered.
+    uint32_t packetsCrcError;   // Received but dropped by the LoRa device payload CRC.
+    uint32_t packetsInvalid;    // Received with unknown header or checksum mismatch.
+    uint32_t packetsFiltered;   // Received but directed to another radioId, or sent in the same direction, Terminal to Gateway or Gateway to Terminal, such as own payloads forwarded back by a relay.
+    uint32_t packetsRelayed;    // Terminal: received for another radioId and forwarded, see 'setRelay'.
+    uint32_t packetsUndelivered;// Received but dropped because the delivery queue was full, see 'startTask'.
+    uint32_t ackLatency[LORACOMM_STATS_LATENCY_BUCKETS];   // ACK round trip histogram, from the last send to its ACK, see 'LORACOMM_STATS_LATENCY_MIN'.
 } LoRaStatistics_t;
 
 typedef struct {
-    uint8_t tagId = LORACOMM_INVALID_TAGID;
-    LoRaOnReceiveCallback callback;
-} LoRaOnReceiveCallback_t;
+    uint32_t packetsSent;       // Including retries.
+    uint32_t packetsReceived;
+    uint32_t bytesSent;         // Including header.
+    uint32_t bytesReceived;     // Including header.
+    uint32_t retries;           // Payloads sent again because no ACK was received.
+    uint32_t dropped;           // Payloads dropped after all retries without ACK.
+    uint32_t queueFull;         // Payloads not queued because the send queue was full.
+    uint32_t airtime;           // Time on air in millis of the payloads sent.
+} LoRaTagStatistics_t;
+
+typedef struct {
+    uint32_t packetsSent;       // Including retries.
+    uint32_t bytesSent;         // Including header.
+    uint32_t bytesReceived;     // Including header.
+    uint32_t retries;           // Payloads sent again because no ACK was received.
+    uint32_t dropped;           // Payloads dropped after all retries without ACK.
+    uint32_t airtime;           // Time on air in millis of the payloads sent.
+    uint32_t ackLatency[LORACOMM_STATS_LATENCY_BUCKETS];   // ACK round trip histogram, see 'LORACOMM_STATS_LATENCY_MIN'.
+} LoRaPeerStatistics_t;
+
+typedef struct {
+    uint8_t     tagId;      // TagId of the whole payload.
+    uint8_t     messageId;  // Identifies the payload among the ones sent by the same controller.
+    uint8_t     index;      // Index of this fragment, each one carries 'LORACOMM_FRAGMENT_DATA_MAX' bytes except the last.
+    uint8_t     count;      // Total number of fragments.
+} LoRaFragmentHeader_t;
+
+typedef struct {
+    uint8_t     messageId;  // Payload being acknowledged.
+    uint8_t     reserved[3] = {};
+    uint32_t    received;   // Bitmap of received fragments, bit N is fragment index N.
+} LoRaFragmentAck_t;
+
+typedef struct {
+    uint32_t    period;     // Time in millis between beacons, the beacon reception is the time reference of the slots.
+    uint16_t    slotTime;   // Time in millis of each slot.
+    uint16_t    slotCount;  // Number of slots, each Terminal uses the one of its radioId hash.
+} LoRaBeacon_t;
+
+typedef struct {
+    uint8_t     tagId;      // TagId of this record.
+    uint8_t     size;       // Number of data bytes that follow.
+} LoRaAggregateRecord_t;
 
 #define LORACOMM_FLAG_IDX_IS_TERMINAL 0
 #define LORACOMM_FLAG_IDX_REQUIRE_ACK 1
 #define LORACOMM_FLAG_IDX_IS_ACK      2
+#define LORACOMM_FLAG_IDX_HAS_CRC16   3 // Header v2 only, the CRC16 of the content follows the radioId.
+#define LORACOMM_FLAG_MASK            0x07  // Flags that are the same on every header version.
+
+/**
+ * Header v2, variable length from 3 to 11 bytes, 3 to 9 without CRC16 and 5 to 11 with it:
+ * byte 0   -> bits [4..7] version 'LORACOMM_HEADER_VERSION_2', bits [0..3] flags, same as 'LoRaHeader_t' plus 'LORACOMM_FLAG_IDX_HAS_CRC16'
+ * byte 1   -> tagId
+ * + 1 byte -> seq, only if 'LORACOMM_FLAG_IDX_REQUIRE_ACK' is set
+ * + 1 byte -> hops, only if version is 'LORACOMM_HEADER_VERSION_2_RELAYED', so payloads not forwarded by a relay do not carry it
+ * + 1 to 5 bytes -> radioId, varint of 7 bits per byte with the least significant first, bit 7 set if more bytes follow
+ * + 2 bytes-> CRC16 of the content, little endian, only if 'LORACOMM_FLAG_IDX_HAS_CRC16' is set
+ * 
+ * Header v1 has no version, it is recognized by its checksum. Header v2 has no checksum, the one used to ACK
+ * is calculated by both sides from the content, so ACKs are the same on both versions. For encrypted payloads
+ * header v2 uses the MIC as checksum instead, it is already unique per payload.
+ */
+#define LORACOMM_HEADER_VERSION_2   2
+#define LORACOMM_HEADER_VERSION_2_RELAYED   3   // Header v2 with hops.
+enum ELoRaHeaderFormat : uint8_t {
+    LORA_HEADER_V1,         // 'LoRaHeader_t', 12 bytes, understood by every firmware version.
+    LORA_HEADER_V2,         // Compact, 3 to 9 bytes, without checksum relies only on the LoRa packet CRC, see 'setCrc', and 'setCryptoPhrase' is not checked. Encrypted payloads are checked by their MIC. Receivers must allow it, see 'setHeaderUnchecked'.
+    LORA_HEADER_V2_CRC16,   // Compact with CRC16 of the content, 5 to 11 bytes.
+};
+
 typedef struct {
                 /**
                  * Payload checksum, excluding the header.
@@ -74,23 +252,108 @@ typedef struct {
     uint8_t     flags;
     uint8_t     tagId;
     /////////////////////
-    uint16_t    reserved = 0;   // Reserved: 2 bytes padding.
+    uint8_t     hops = 0;       // Number of relays that forwarded this payload, see 'setRelay'. Not part of the checksum, so relays can change it.
+    uint8_t     seq = 0;        // Sequence number of payloads requiring ACK, the same on retries, see 'LORACOMM_DEDUP_WINDOW'. 0 if none, always from older firmware where it was reserved.
 } LoRaHeader_t;
 
 typedef struct {
     bool        requiresACK;
-    uint8_t     retryCount;
+    bool        isReserved;     // True while the payload is being written in place, between 'sendReserve' and 'sendCommit'.
+    bool        isEncrypted;    // Content encrypted in place when committed, sent with tagId 'LORACOMM_TAGID_ENCRYPTED'.
+    bool        isCompressed;   // Content compressed in place when committed, sent with tagId 'LORACOMM_TAGID_COMPRESSED', or inside the encrypted content.
+    ELoRaPriority priority;
+    uint8_t     retryCount;     // Number of times this payload was already sent.
     uint64_t    nextRetryAt;
-    size_t      payloadSize;    // if == 0, then assume this element in the 'm_sendQueue' is empty
-    uint8_t     payload[LORA_PACKET_MAX_SIZE]; // Includes header, which can be accessed by using by casting this pointer to 'LoRaHeader_t*'.
+    uint64_t    lastSentAt;     // Used to measure the ACK round trip.
+    uint64_t    queuedAt;       // Used to drop ACKs that could not be sent before the sender retries.
+    size_t      payloadSize;    // Size of header and payload, if == 0, then assume this element in the 'm_sendQueue' is empty
+    LoRaHeader_t header;
+    ELoRaHeaderFormat headerFormat;                 // Header format to send with.
+    uint8_t     headerSize;                         // Size of 'headerEncoded'.
+    uint8_t     headerEncoded[sizeof(LoRaHeader_t)];// Header as sent, encoded from 'header' when queued for send.
+    uint8_t     payload[LORACOMM_SEND_PAYLOAD_MAX+LORACOMM_CRYPTO_OVERHEAD]; // Payload content only, excluding header.
 } LoRaSend_t;
 
-#define LORACOMM_SIGNAL_QUALITY_COUNT_MAX 64
+#define LORACOMM_ADR_MARGIN             10.0f   // SNR in dB above the demodulation floor required to use a spreading factor.
+#define LORACOMM_ADR_HYSTERESIS         3.0f    // Extra SNR in dB required to move a radioId to a lower spreading factor, avoids flapping.
+#define LORACOMM_ADR_PACKETS_MIN        4       // Payloads received from a radioId before its signal quality is trusted by ADR.
+#define LORACOMM_ADR_SF_MIN             7       // Lowest spreading factor ADR assigns, SF6 requires implicit header.
+#define LORACOMM_ADR_TX_POWER_MIN       2       // Lowest transmit power in dBm ADR uses.
+#define LORACOMM_ADR_FALLBACK_TIMEOUT   600000  // Terminal: time in millis without receiving from the Gateway after which it goes back to its default spreading factor.
+
+typedef struct {
+    uint32_t    radioId;
+    uint8_t     tagId;
+    uint8_t     messageId;
+    uint8_t     count;          // Number of fragments, if == 0 then assume this element is empty.
+    uint8_t     retryCount;     // Number of times missing fragments were sent again.
+    ELoRaPriority priority;
+    uint32_t    acked;          // Bitmap of fragments the receiver has.
+    uint32_t    pending;        // Bitmap of fragments still to be placed in the send queue in this round.
+    uint64_t    nextRetryAt;    // When to ask again for 'LoRaFragmentAck_t' if none received, valid when 'pending' == 0, 0 while fragments are still in the send queue.
+    size_t      size;
+    uint8_t     payload[LORACOMM_MESSAGE_SIZE_MAX];
+} LoRaFragmentTx_t;
+
+typedef struct {
+    uint32_t    radioId;
+    uint8_t     tagId;
+    uint8_t     messageId;
+    uint8_t     count;          // Number of fragments, if == 0 then assume this element is empty.
+    bool        completed;      // Already delivered, kept only to re-ACK fragments sent again.
+    uint32_t    received;       // Bitmap of received fragments.
+    uint64_t    lastUpdateAt;
+    size_t      size;
+    uint8_t     payload[LORACOMM_MESSAGE_SIZE_MAX];
+} LoRaFragmentRx_t;
+
+typedef struct {
+    uint32_t    radioId;
+    uint32_t    counter;        // Highest encryption counter received, if == 0 then assume this element is empty.
+    uint32_t    window;         // Bit N set if counter 'counter'-N was received, see 'LORACOMM_CRYPTO_REPLAY_WINDOW'.
+} LoRaCryptoPeer_t;
+
 typedef struct {
-    uint64_t lastUpdateAt;
+    uint64_t    receivedAt;     // if == 0, then assume this element is empty
+    uint32_t    radioId;
+    uint32_t    checksum;
+    uint32_t    window;         // Time in millis this element is remembered.
+    uint8_t     seq;            // 'LoRaHeader_t::seq', 0 if the sender has none.
+} LoRaDedup_t;
+
+typedef struct {
+    uint32_t    radioId;
+    uint8_t     tagId;
+    int         rssi;
+    float       snr;
+    size_t      size;
+    uint8_t     payload[LORACOMM_MESSAGE_SIZE_MAX];
+} LoRaDelivery_t;
+
+typedef struct {
+    LoRaSend_t* sendElement;    // Reserved element of the send queue where records are appended, if == NULL then assume this element is empty.
+    uint64_t    commitAt;       // When the window ends and the aggregated payload is queued for send.
+    size_t      size;           // Number of bytes already appended.
+} LoRaAggregate_t;
+
+#ifndef LORACOMM_SIGNAL_QUALITY_COUNT_MAX
+    #define LORACOMM_SIGNAL_QUALITY_COUNT_MAX   256     // Number of radioIds tracked, must be a power of 2.
+#endif
+#define LORACOMM_SIGNAL_QUALITY_PROBE_MAX   8       // Slots probed from the radioId hash, when all in use the least recently updated is replaced.
+#define LORACOMM_SIGNAL_QUALITY_EWMA_ALPHA  0.25f   // Weight of a new sample in the averages, higher reacts faster, lower is smoother.
+typedef struct {
+    uint64_t lastUpdateAt;  // if == 0, then assume this element is empty
     uint32_t radioId;
-    int rssi;
-    float snr;
+    uint32_t packets;       // Number of payloads received from this radioId since it was added.
+    int rssi;               // Last received.
+    float snr;              // Last received.
+    float rssiAvg;          // Exponentially weighted moving average.
+    float snrAvg;           // Exponentially weighted moving average.
+    uint8_t spreadingFactor;        // Spreading factor this radioId receives on, assigned by ADR, 0 if the default.
+    uint8_t spreadingFactorPending; // Spreading factor sent to this radioId and waiting for ACK, 0 if none.
+    LoRaPeerStatistics_t stats;     // Counters since this radioId was added, payloads received are 'packets'.
+    uint8_t relayHops;              // Hops of the last payload received through relays, 0 if only received directly. Signal quality is only from direct payloads.
+    uint64_t relayedAt;             // When the last payload through relays was received, see 'LORACOMM_RELAY_DEDUP_WINDOW'.
 } LoRaSignalQuality_t;
 
 
@@ -107,6 +370,7 @@ class LoRaComm {
          * @param   carrierFrequency LoRa carrier frequency, see comment about 'usable radio frequencies' comment on the top of the LoRaTxRx class.
          * @param   isTerminal True when controller is a 'Terminal', false when is a 'Gateway'; same analogy as a cellular network.
          * @param   terminalRadioId RadioId, only used if 'isTerminal' == true, ignored if Gateway. Used to discard payloads that do not belong to this Terminal.
+         * @param   spi SPI bus of the LoRa device, NULL for the default 'SPI'.
          * @return  True if hardware found and initialized, false otherwise.
          * @note	This function must be called prior to any other LoraComm functions.
          */
@@ -114,22 +378,89 @@ class LoRaComm {
             uint8_t pinMOSI, uint8_t pinMISO, uint8_t pinSCLK, uint8_t pinCS,
             uint8_t pinReset, uint8_t pinDIO0,
             uint16_t carrierFrequency,
-            bool isTerminal, uint32_t terminalRadioId
+            bool isTerminal, uint32_t terminalRadioId,
+            SPIClass* spi = NULL
         );
 
+        /**
+         * @brief   Add a receive only LoRa device, Gateway only. Payloads it receives are handled the same as the ones of the LoRa device
+         *          of \ref 'init', which is the only one used to send.
+         * @param   radio LoRa device already initialized, with its own pins, and configured, not owned and must outlive this LoRaComm.
+         * @return  True if added, false if a Terminal, NULL, already \ref 'LORACOMM_RADIO_EXTRA_MAX' added, or on the frequency of the
+         *          LoRa device of \ref 'init' or of another one added.
+         * @note    Spreading factor, bandwidth, frequency and CRC of added LoRa devices are not changed by LoRaComm,
+         *          set each one to another frequency of the channel plan to serve several channels at once, see \ref 'setChannelPlan'.
+         *          On the same frequency every payload would be received twice, so it is not accepted, and keep \ref 'setChannel' off
+         *          the channels of the added ones.
+         *          With a channel plan and added LoRa devices, the LoRa device of \ref 'init' sends each payload on the channel of its
+         *          radioId, see \ref 'getChannelOf', and goes back to the channel set with \ref 'setChannel' when done.
+         *          The added LoRa device on that channel also hears it, and drops it as sent by a Gateway.
+         *          TDMA beacons are only sent on that channel.
+         *          Also enabled and disabled with \ref 'enable' and \ref 'disable', and counted in \ref 'getStatistics'.
+         */
+        bool addRadio(LoRaTxRx* radio);
+
         /**
          * @brief   Value used by checksum calculation.
          * @param   phrase A value known by both parties to further improve data validation, if '0' then phrase is not added to checksum calculation.
          */
         void setCryptoPhrase(uint8_t phrase);
 
+        /**
+         * @brief   Authenticated encryption of every payload with AES-128 CCM, using the ESP32 AES accelerator through mbedTLS.
+         *          Each payload carries a counter, part of the nonce, and a MIC that replaces the checksum validation.
+         *          Payloads without encryption, or with a MIC that does not match, are dropped. Replayed ones are ACKed again but not delivered.
+         * @param   key Key of \ref 'LORACOMM_CRYPTO_KEY_SIZE' bytes, shared by the Gateway and its Terminals, NULL to disable which is the default.
+         * @param   counter Counter of the last payload sent with this key, see \ref 'getEncryptionCounter'.
+         * @return  True if set, false if the key could not be used.
+         * @note    A nonce must never repeat for the same key, persist \ref 'getEncryptionCounter' and restore it on boot.
+         *          Also, receivers reject counters they already saw, so a counter that goes back is not received until it passes the old one.
+         *          A Terminal tracks a single counter for downlinks, it must be served by one Gateway.
+         *          A Gateway tracks the counter of up to \ref 'LORACOMM_CRYPTO_PEER_MAX' Terminals and drops payloads from more. Counters received
+         *          are only kept in RAM, after a reboot old payloads are accepted once again.
+         *          Broadcast payloads, TDMA beacons, are not encrypted.
+         */
+        bool setEncryptionKey(const uint8_t* key, uint32_t counter);
+
+        /**
+         * @brief   Check if payloads are encrypted.
+         * @return  True if a key is set, false otherwise.
+         */
+        inline bool isEncryptionEnabled() { return m_cryptoEnabled; }
+
+        /**
+         * @brief   Compress payloads with a dictionary shared by both parties, so the keys and values repeated on every payload take fewer bytes on air.
+         *          Each payload is only sent compressed if smaller, flagged with tagId \ref 'LORACOMM_TAGID_COMPRESSED'.
+         * @param   enable True to compress payloads sent, false to send them as is which is the default.
+         * @param   dictionary Bytes likely to appear in payloads, usually a 'const' array so it stays in flash, not copied and must outlive this LoRaComm.
+         *          Most common last, only the last 'COMPRESS_WINDOW_MAX' bytes are used. NULL for no dictionary.
+         * @param   size Size of the dictionary.
+         * @note    Compressed payloads are always received, those compressed with another dictionary are dropped.
+         *          Compressed before \ref 'setEncryptionKey' encryption, since encrypted bytes do not compress.
+         */
+        void setCompression(bool enable, const uint8_t* dictionary = NULL, size_t size = 0);
+
+        /**
+         * @brief   Check if payloads are compressed.
+         * @return  True if enabled with \ref 'setCompression', false otherwise.
+         */
+        inline bool isCompressionEnabled() { return m_compressEnabled; }
+
+        /**
+         * @brief   Counter of the last payload encrypted, incremented on every payload sent.
+         * @return  Counter value.
+         * @note    To avoid writing on every send, persist this plus a margin every time that margin is used, and restore the persisted value.
+         */
+        inline uint32_t getEncryptionCounter() { return m_cryptoCounter; }
+
         /**
          * @brief   Control how long each symbol is transmitted.
          * @param   sf Spreading factor range: [6,12], if outside will adjust to nearest value.
          * @note    Lower Spreading Factor:  shorter range, higher data rate.
          *          Higher Spreading Factor: longer range, lower data rate.
+         *          On a Terminal that was assigned a spreading factor by ADR, this is only used to send until the assignment falls back.
          */
-        void setSpreadingFactor(uint8_t sf) { m_lora.setSpreadingFactor(sf); }
+        void setSpreadingFactor(uint8_t sf);
 
         /**
          * @brief   Control how loud to transmit.
@@ -137,7 +468,7 @@ class LoRaComm {
          * @note    Lower power:  shorter range, higher battery life.
          *          Higher power: longer range, lower battery life.
          */
-        void setTxPower(uint8_t power) { m_lora.setTxPower(power); }
+        void setTxPower(uint8_t power);
 
         /**
          * @brief   Control communication bandwidth.
@@ -145,14 +476,183 @@ class LoRaComm {
          * @note    Lower bandwidth:  longer range, lower data rate, longer airtime.
          *          Higher bandwidth: shorter range, higher data rate, shorter airtime.
          */
-        void setBandwidth(ELoRaBandwidth bandwidth) { m_lora.setBandwidth(bandwidth); }
+        void setBandwidth(ELoRaBandwidth bandwidth);
+
+        /**
+         * @brief   Channel plan, spreads Terminals across several carrier frequencies so each one has fewer controllers contending for it.
+         *          A Terminal uses the channel of its radioId, see \ref 'getChannelOf', to send and receive.
+         *          A Gateway uses the channel set with \ref 'setChannel', 0 by default, and serves the Terminals on that channel.
+         * @param   frequencies Carrier frequencies in Hz, the same list in the same order on every controller of the site.
+         * @param   count Number of frequencies, up to \ref 'LORACOMM_CHANNEL_COUNT_MAX', 0 to go back to the 'init' carrier frequency.
+         * @return  True if the channel plan was set, false if 'count' is above the maximum or the LoRa device is transmitting.
+         * @note    Each Gateway listens on a single channel, a site needs one Gateway per channel to hear every Terminal,
+         *          or LoRa devices added for the other channels, see \ref 'addRadio'.
+         *          The duty cycle budget is tracked per sub-band, so channels on different sub-bands also spread the budget.
+         */
+        bool setChannelPlan(const uint32_t* frequencies, uint8_t count);
+
+        /**
+         * @brief   Change the channel to use from the channel plan.
+         * @param   channel Index in the channel plan.
+         * @return  True if changed, false if no channel plan, 'channel' outside of it or the LoRa device is transmitting.
+         * @note    A Terminal on a channel other than the one of its radioId is only heard by a Gateway set to that channel.
+         */
+        bool setChannel(uint8_t channel);
+
+        /**
+         * @brief   Get the channel in use from the channel plan.
+         * @return  Index in the channel plan, 0 if no channel plan.
+         */
+        inline const uint8_t getChannel() { return m_channel; }
 
         /**
-         * @brief   Get current spreading factor.
+         * @brief   Get the channel a Terminal uses by default, so a Gateway knows which Terminals it serves.
+         * @param   radioId RadioId of the Terminal.
+         * @return  Index in the channel plan, 0 if no channel plan.
+         */
+        uint8_t getChannelOf(uint32_t radioId);
+
+        /**
+         * @brief   Gateway: time division of the channel. A beacon is sent every 'period' and each Terminal that receives it only sends in its
+         *          own slot, so Terminals no longer collide with each other.
+         * @param   period Time in millis between beacons, 0 to disable which is the default.
+         * @param   slotTime Time in millis of each slot, must fit the longest payload Terminals send plus its ACK and \ref 'LORACOMM_TDMA_SLOT_GUARD'.
+         * @return  True if set, false if 'slotTime' is 0 or the period does not fit at least 1 slot after \ref 'LORACOMM_TDMA_BEACON_GUARD'.
+         * @note    Slots are assigned by radioId hash, Terminals sharing a slot still contend with each other but much less than on the whole period.
+         *          The Gateway itself is not bound to slots, its replies fall in the slot of the Terminal that it is answering.
+         *          Terminals that did not receive a beacon for \ref 'LORACOMM_TDMA_BEACON_LOST_MAX' periods send at any time.
+         *          Beacons are sent on the default spreading factor, ADR does not assign another one while enabled, see \ref 'setAdr'.
+         */
+        bool setTdma(uint32_t period, uint16_t slotTime);
+
+        /**
+         * @brief   Terminal: check if sending is bound to a slot of a Gateway beacon.
+         * @return  True if a beacon was received recently, false otherwise.
+         */
+        inline const bool isTdmaSynced() { return m_tdmaBeaconAt != 0; }
+
+        /**
+         * @brief   Listen before talk. Before each send, the LoRa device checks if another controller is sending and if so the send waits
+         *          a random time between \ref 'LORACOMM_LBT_BACKOFF_MIN' and \ref 'LORACOMM_LBT_BACKOFF_MAX' before checking again.
+         * @param   enable True to enable, false to send without checking, which is the default.
+         * @note    Does not block, the check runs between 2 calls to \ref 'maintain' and waiting does not count as a retry.
+         *          Only detects controllers on the same spreading factor as the one receiving on.
+         */
+        void setLbt(bool enable);
+
+        /**
+         * @brief   Get listen before talk state.
+         * @return  True if enabled, false otherwise.
+         */
+        inline const bool isLbtEnabled() { return m_lbtEnabled; }
+
+        /**
+         * @brief   Receive schedule, for battery powered Terminals. The Terminal only listens for 'window' after each payload it sends and every
+         *          'wakePeriod' after that, sleeping in between. The Gateway, set with the same values, holds payloads to a Terminal until it listens.
+         * @param   window Time in millis to listen, must fit the ACK and the replies the Gateway sends right after an uplink, 0 to disable which is the default.
+         * @param   wakePeriod Time in millis between receive windows without uplink, 0 to only listen after an uplink.
+         * @note    Terminal: the LoRa device is woken to send and stays awake while the send queue has payloads ready, \ref 'disable' stops the schedule.
+         *          Gateway: the schedule of each Terminal starts on the last payload received from it, payloads are sent only if they fit in a window.
+         *          A sleeping Terminal does not receive TDMA beacons, see \ref 'setTdma'.
+         */
+        void setRxSchedule(uint32_t window, uint32_t wakePeriod);
+
+        /**
+         * @brief   Relay, Terminal only. Payloads to and from the listed radioIds are forwarded, so Terminals out of reach of the Gateway,
+         *          or only in reach at a high spreading factor, are served through this one at a lower spreading factor.
+         * @param   radioIds Terminals to forward payloads for, up to \ref 'LORACOMM_RELAY_ROUTE_MAX'.
+         * @param   count Number of radioIds, 0 to disable which is the default.
+         * @return  True if set, false if a Gateway or 'count' too large.
+         * @note    Meant for mains powered Terminals, the LoRa device stays in receive, see \ref 'setRxSchedule'.
+         *          Forwarded payloads keep their header and content, ACKs and retries stay end to end, and encrypted ones do not need the key.
+         *          Routes are not learned, a relay only forwards for the listed radioIds. Gateway and Terminals do see that a radioId is
+         *          behind a relay from the hops of the payloads received, and then also drop copies received both directly and through
+         *          the relay, wait longer for ACKs, and ADR is not used for it. A payload received directly, after
+         *          \ref 'LORACOMM_RELAY_DEDUP_WINDOW' without relayed ones, means the radioId is in reach again.
+         *          Broadcast payloads, TDMA beacons, are not forwarded.
+         */
+        bool setRelay(const uint32_t* radioIds, uint8_t count);
+
+        /**
+         * @brief   Control the payload CRC calculated and checked by the LoRa device, corrupted packets are dropped before reaching LoRaComm.
+         * @param   enable True to send every packet with CRC, false to send without it, which is the default.
+         * @note    Packets without CRC are still received, so controllers with and without it can be in the same network.
+         */
+        void setCrc(bool enable);
+
+        /**
+         * @brief   Get current spreading factor used to receive.
          * @return  Spreading factor value range: [6,12].
          */
         inline const uint8_t getSpreadingFactor() { return m_lora.getSpreadingFactor(); }
 
+        /**
+         * @brief   Adaptive data rate, Gateway only. Each payload is sent with the lowest spreading factor and transmit power that still
+         *          have \ref 'LORACOMM_ADR_MARGIN' of SNR for the destination radioId, based on its signal quality.
+         *          The Gateway keeps receiving on its own spreading factor, so Terminals keep sending on it.
+         * @param   enable True to enable, false to send everything with the configured spreading factor and transmit power, which is the default.
+         * @note    The Gateway assigns a spreading factor with an internal payload. The Terminal listens on it as soon as it receives the assignment,
+         *          the Gateway only sends on it after the ACK. Retries of the assignment alternate between both spreading factors, so a lost ACK
+         *          does not leave the Terminal out of reach.
+         *          If a payload to it is dropped without ACK, the Gateway goes back to the default for that radioId, and the Terminal does the same
+         *          after \ref 'LORACOMM_ADR_FALLBACK_TIMEOUT' without receiving anything.
+         *          While TDMA is enabled, see \ref 'setTdma', Terminals are kept on the default spreading factor so they still receive the beacons,
+         *          only the transmit power is adapted.
+         */
+        void setAdr(bool enable);
+
+        /**
+         * @brief   Get adaptive data rate state.
+         * @return  True if enabled, false otherwise.
+         */
+        inline const bool isAdrEnabled() { return m_adrEnabled; }
+
+        /**
+         * @brief   Header format used to send, payloads are received in any format.
+         * @param   format \ref 'ELoRaHeaderFormat', default is \ref 'LORA_HEADER_V1'.
+         * @note    Controllers in older firmware only receive \ref 'LORA_HEADER_V1', update the Gateways first and the Terminals after.
+         *          ACKs are always sent in the format of the payload being acknowledged.
+         *          Receivers drop \ref 'LORA_HEADER_V2' unless enabled with \ref 'setHeaderUnchecked', prefer \ref 'LORA_HEADER_V2_CRC16'.
+         */
+        void setHeaderFormat(ELoRaHeaderFormat format);
+
+        /**
+         * @brief   Get header format used to send.
+         * @return  \ref 'ELoRaHeaderFormat'.
+         */
+        inline const ELoRaHeaderFormat getHeaderFormat() { return m_headerFormat; }
+
+        /**
+         * @brief   Receive payloads with \ref 'LORA_HEADER_V2', which have no checksum of their own.
+         * @param   enable True to receive them, false to drop them as invalid, which is the default.
+         * @note    Only enable when every controller that sends them has the LoRa device CRC enabled, see \ref 'setCrc'. Otherwise a corrupted
+         *          packet can be taken for one of these, and delivered with a random tagId and radioId.
+         *          Encrypted payloads are always received in any header format, their MIC is checked instead.
+         */
+        void setHeaderUnchecked(bool enable);
+
+        /**
+         * @brief   Check if payloads with \ref 'LORA_HEADER_V2' are received.
+         * @return  True if enabled with \ref 'setHeaderUnchecked', false otherwise.
+         */
+        inline const bool isHeaderUnchecked() { return m_headerUnchecked; }
+
+        /**
+         * @brief   Frame aggregation. Small payloads to the same radioId are held for a window and packed together in a single LoRa packet,
+         *          sharing one header, preamble and ACK. The receiver delivers each one to its own \ref 'onReceive' callback.
+         * @param   window Time in millis to hold a payload waiting for others to the same radioId, 0 to disable which is the default.
+         * @note    The packet is queued for send when the window of its first payload ends or when the next payload does not fit.
+         *          If any of its payloads 'requireAck', the whole packet is acknowledged and retried.
+         *          Both sides must support aggregation, a receiver without it delivers the packet to \ref 'onReceiveAny' with tagId \ref 'LORACOMM_TAGID_AGGREGATE'.
+         */
+        void setAggregation(uint32_t window);
+
+        /**
+         * @brief   Get frame aggregation window.
+         * @return  Time in millis a payload is held for aggregation, 0 if disabled.
+         */
+        inline const uint32_t getAggregation() { return m_aggregateWindow; }
+
         /**
          * @brief   Get current transmit power.
          * @return  Transmit power value range: [0,20].
@@ -165,14 +665,50 @@ class LoRaComm {
          */
         inline const ELoRaBandwidth getBandwidth() { return m_lora.getBandwidth(); }
 
+        /**
+         * @brief   Calculate how long a payload occupies the channel.
+         * @param   size Size of the payload in bytes, excluding header.
+         * @return  Time on air in micros, for the current spreading factor and bandwidth.
+         * @note    Counts the header as \ref 'LORA_HEADER_V1', the largest one, so it is an upper bound for the other formats.
+         */
+        inline uint32_t getTimeOnAir(size_t size) { return m_lora.timeOnAir(sizeof(LoRaHeader_t)+size); }
+
+        /**
+         * @brief   Enforce a duty cycle per frequency sub-band, payloads in the send queue are deferred until they fit the airtime budget.
+         * @param   subBands Array of sub-bands, must stay valid while in use, example \ref 'LORA_SUBBANDS_EU868'. NULL to disable, which is the default.
+         * @param   count Number of sub-bands in the array.
+         */
+        void setDutyCycle(const LoRaSubBand_t* subBands, uint8_t count);
+
+        /**
+         * @brief   Get the airtime still available for the current frequency.
+         * @return  Airtime in micros, UINT64_MAX if the current frequency is not limited.
+         */
+        inline uint64_t getDutyCycleAvailable() { return m_dutyCycle.getAvailable(m_lora.getFrequency()); }
+
         /**
          * @brief   Keeps the LoRa communication alive, if new payload, then calls the appropriate user callback for it.
-         * @note    Call this function periodically to parse new received messages.
+         *          Also sends the payloads in the send queue that are ready, and retries the ones that were not ACKed in time.
+         * @note    Call this function periodically to parse new received messages and to send the queued ones.
+         *          After \ref 'startTask', only calls the user callbacks of the payloads received by the task.
          */
         void maintain();
 
         /**
-         * @brief   Idle/Standby the LoRa communication and device.
+         * @brief   Run the LoRa communication in its own task, so its timing does not depend on how often \ref 'maintain' is called.
+         *          The task receives, sends and retries, and places the payloads received in a queue of \ref 'LORACOMM_DELIVERY_QUEUE_SIZE'.
+         *          User callbacks are still called by \ref 'maintain', on the task that calls it.
+         * @param   core Core to pin the task to, or 'tskNO_AFFINITY'.
+         * @param   priority Task priority.
+         * @return  True if the task is running, false if unable to create it.
+         * @note    Call after \ref 'init' and the configuration. The task cannot be stopped.
+         *          Functions of this class can still be called from other tasks, they wait for the task to finish its current run.
+         *          Pointers returned by \ref 'getSignalQuality' and \ref 'getSignalQualityNext' may be updated by the task while in use.
+         */
+        bool startTask(BaseType_t core, UBaseType_t priority = LORACOMM_TASK_PRIORITY);
+
+        /**
+         * @brief   Wake the LoRa communication and device, placing it in receive.
          */
         void enable();
 
@@ -183,7 +719,7 @@ class LoRaComm {
 
         /**
          * @brief   Get LoRa communication and device state.
-         * @return  True if on idle/standby, false if on sleep.
+         * @return  True if on receive/transmit, false if on sleep.
          */
         inline const bool isEnabled() { return m_lora.isEnabled(); }
 
@@ -191,8 +727,11 @@ class LoRaComm {
          * @brief   Registers a callback function to be called when the LoRa communication receives a sepecific tagId.
          * @param   tagId Identifies the type of the payload.
          * @param   callback The callback function with the signature void(const uint8_t* payload, size_t size, int rssi, float snr) to be registered.
-         * @return  True if there was space in the internal 'm_onReceiveCallbacks' array to add the tagId, false if full and could not be added.
+         * @return  True if the callback was registered, false if callback is NULL, tagId is reserved, see \ref 'LORACOMM_TAGID_RESERVED_MIN',
+         *          or \ref 'LORACOMM_ONRECEIVE_SIZE_MAX' tagIds already have a callback.
          * @note    Calling this function for same tagId will replace old callback.
+         *          Callbacks are called by \ref 'maintain' without the lock, so the task of \ref 'startTask' keeps running while they do.
+         *          With that task, change callbacks from the task that calls \ref 'maintain'.
          */
         bool onReceive(uint8_t tagId, LoRaOnReceiveCallback callback);
 
@@ -202,23 +741,108 @@ class LoRaComm {
          */
         void removeOnReceive(uint8_t tagId);
 
+        /**
+         * @brief   Registers a catch-all callback function, called when a tagId is received that has no callback registered with \ref 'onReceive'.
+         * @param   callback The callback function with the signature void(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr) to be registered, NULL to remove.
+         */
+        void onReceiveAny(LoRaOnReceiveAnyCallback callback);
+
         /**
          * @brief   Queues a payload to be sent over LoRa.
          * @param   radioId Radio identifier, also known as controller 'serial'.
          * @param   tagId Identifies the type of the payload.
          * @param   requireAck True if should be acknowledged and retry if necessary, false send blindly once.
          * @param   payload Payload to be sent.
-         * @param   size Size of the payload, up to \ref 'LORACOMM_SEND_PAYLOAD_MAX', if above will truncate.
-         * @return  True if payload was queued for send, false if unable because send queue is full.
+         * @param   size Size of the payload, up to \ref 'LORACOMM_MESSAGE_SIZE_MAX'.
+         * @return  True if payload was queued for send, false if unable because send queue is full, the payload airtime is larger than the duty cycle budget
+         *          or tagId is reserved, see \ref 'LORACOMM_TAGID_RESERVED_MIN'.
+         * @note    Payloads above \ref 'LORACOMM_SEND_PAYLOAD_MAX' are split in fragments, which are always acknowledged by the receiver with a bitmap
+         *          and only the missing ones are sent again. Returns false if \ref 'LORACOMM_FRAGMENT_TX_POOL_SIZE' fragmented payloads are already being sent.
+         * @note    Returns right away, the payload is sent on the next calls to \ref 'maintain', deferred while the duty cycle budget does not allow it.
+         *          If 'requireAck', it is sent up to 1+'LORACOMM_SEND_RETRY_MAX' times until an ACK is received, then dropped.
          */
         bool send(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size);
 
+        /**
+         * @brief   Queues a payload to be sent over LoRa with a priority, see \ref 'send'.
+         * @param   radioId Radio identifier, also known as controller 'serial'.
+         * @param   tagId Identifies the type of the payload.
+         * @param   requireAck True if should be acknowledged and retry if necessary, false send blindly once.
+         * @param   payload Payload to be sent.
+         * @param   size Size of the payload, up to \ref 'LORACOMM_MESSAGE_SIZE_MAX'.
+         * @param   priority \ref 'LORA_PRIORITY_CONTROL' or \ref 'LORA_PRIORITY_TELEMETRY', which is the one used by \ref 'send' without priority.
+         * @return  Same as \ref 'send'.
+         * @note    Payloads ready to be sent with higher priority go first. Only \ref 'LORA_PRIORITY_TELEMETRY' payloads are aggregated, see \ref 'setAggregation'.
+         */
+        bool send(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size, ELoRaPriority priority);
+
+        /**
+         * @brief   Reserves space in the send queue, so the payload can be written directly into it instead of being copied.
+         * @param   radioId Radio identifier, also known as controller 'serial'.
+         * @param   tagId Identifies the type of the payload.
+         * @param   requireAck True if should be acknowledged and retry if necessary, false send blindly once.
+         * @return  Pointer where to write the payload, up to \ref 'LORACOMM_SEND_PAYLOAD_MAX' bytes, NULL if send queue is full or tagId is reserved.
+         * @note    Must be followed by \ref 'sendCommit' or \ref 'sendAbort', while reserved that space is not used by other sends.
+         *          Payloads do not fragment on this path, use \ref 'send' for payloads above \ref 'LORACOMM_SEND_PAYLOAD_MAX'.
+         */
+        uint8_t* sendReserve(uint32_t radioId, uint8_t tagId, bool requireAck);
+
+        /**
+         * @brief   Reserves space in the send queue with a priority, see \ref 'sendReserve' and \ref 'send'.
+         */
+        uint8_t* sendReserve(uint32_t radioId, uint8_t tagId, bool requireAck, ELoRaPriority priority);
+
+        /**
+         * @brief   Queues for send a payload written in place, see \ref 'sendReserve'.
+         * @param   payload Pointer returned by \ref 'sendReserve'.
+         * @param   size Size of the payload written, up to \ref 'LORACOMM_SEND_PAYLOAD_MAX'.
+         * @return  True if payload was queued for send, false if 'payload' was not reserved, 'size' is too large or the payload airtime is larger
+         *          than the duty cycle budget. On false the reserved space is released.
+         */
+        bool sendCommit(uint8_t* payload, size_t size);
+
+        /**
+         * @brief   Releases the space reserved with \ref 'sendReserve', without sending.
+         * @param   payload Pointer returned by \ref 'sendReserve'.
+         */
+        void sendAbort(uint8_t* payload);
+
+        /**
+         * @brief   Get the signal quality of the payloads received from a radioId.
+         * @param   radioId Radio identifier.
+         * @return  Pointer to signal quality, NULL if nothing received from that radioId or if it was evicted.
+         * @note    Only tracked in Gateway mode.
+         */
+        const LoRaSignalQuality_t* getSignalQuality(uint32_t radioId);
+
+        /**
+         * @brief   Iterate over the signal quality of all tracked radioIds, in no particular order.
+         * @param   iterator Set to 0 to get the first, it is updated so the next call returns the next one.
+         * @return  Pointer to signal quality, NULL when there are no more.
+         * @note    Example:
+         *              uint16_t it = 0;
+         *              const LoRaSignalQuality_t* sq;
+         *              while ((sq = lora.getSignalQualityNext(&it)) != NULL) { ... }
+         */
+        const LoRaSignalQuality_t* getSignalQualityNext(uint16_t* iterator);
+
         /**
          * @brief   Get current LoRa hardware and communication statistics.
          * @param   stats Pointer to struct that will place the statistics into.
          */
         void getStatistics(LoRaStatistics_t* stats);
 
+        /**
+         * @brief   Get the statistics of a tagId, including internal ones.
+         * @param   tagId The tagId.
+         * @param   stats Pointer to struct that will place the statistics into.
+         * @note    Statistics per radioId are in \ref 'getSignalQuality', Gateway only.
+         *          TagIds from \ref 'LORACOMM_STATS_TAG_COUNT' up to the reserved ones share the same statistics.
+         *          Counters are only written by \ref 'maintain', each one is a single word so they can be read from another task without locking,
+         *          but counters in the same snapshot may be from consecutive calls to \ref 'maintain'.
+         */
+        void getTagStatistics(uint8_t tagId, LoRaTagStatistics_t* stats);
+
 
     private:
         /**
@@ -237,36 +861,345 @@ class LoRaComm {
          * @param   isAck True if this is an acknowledging payload, false otherwise.
          * @param   payload Payload to be sent.
          * @param   size Size of the payload, up to \ref 'LORACOMM_SEND_PAYLOAD_MAX', if above will truncate.
+         * @param   priority Send queue priority, \ref 'LORA_PRIORITY_ACK' if 'isAck'.
          * @return  True if payload was queued for send, false if unable because send queue is full.
          */
-        bool _send(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, const uint8_t* payload, size_t size);
+        bool _send(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, const uint8_t* payload, size_t size, ELoRaPriority priority);
 
         /**
          * @brief   Queues a acknowledge payload to be sent over LoRa.
          * @param   radioId Radio identifier, also known as controller 'serial'.
          * @param   tagId Identifies the type of the payload.
          * @param   checksumOfReceived Checksum of the payload content received that requires acknowledge.
+         * @param   format Header format of the payload received, the ACK is sent in the same one.
          * @return  True if payload was queued for send, false if unable because send queue is full.
          */
-        bool _sendAck(uint32_t radioId, uint8_t tagId, uint32_t checksumOfReceived);
+        bool _sendAck(uint32_t radioId, uint8_t tagId, uint32_t checksumOfReceived, ELoRaHeaderFormat format);
+
+        /**
+         * @brief   Encrypt a payload in place, inserting the counter and tagId before the content and appending the MIC.
+         * @param   sendElement Send queue element with the content in 'payload' and the logical header set.
+         * @param   size Size of the content.
+         * @return  Size of the encrypted content, 'size' + \ref 'LORACOMM_CRYPTO_OVERHEAD', 0 if failed.
+         */
+        size_t _encrypt(LoRaSend_t* sendElement, size_t size);
+
+        /**
+         * @brief   Compress a payload in place, with the tagId and dictionary check before the compressed content.
+         * @param   sendElement Send queue element with the content in 'payload' and the logical header set.
+         * @param   size Size of the content.
+         * @return  Size of the content after, 'size' if left uncompressed because it would not be smaller.
+         */
+        size_t _compress(LoRaSend_t* sendElement, size_t size);
+
+        /**
+         * @brief   Decompress the content of a payload received with tagId 'LORACOMM_TAGID_COMPRESSED'.
+         * @param   content Content received, excluding header.
+         * @param   size Size of content.
+         * @param   out Where the decompressed payload is written, up to \ref 'LORACOMM_SEND_PAYLOAD_MAX' bytes.
+         * @param   tagId Where the tagId of the payload is written.
+         * @return  Size written to 'out', 0 if another dictionary or invalid.
+         */
+        size_t _decompress(const uint8_t* content, size_t size, uint8_t* out, uint8_t* tagId);
+
+        /**
+         * @brief   Authenticate and decrypt the content of a payload received with tagId 'LORACOMM_TAGID_ENCRYPTED'.
+         * @param   header Header decoded.
+         * @param   content Content received, excluding header.
+         * @param   size Size of content.
+         * @param   plain Where the decrypted tagId and payload are written, at least 'size' bytes.
+         * @param   counter Where the counter of the payload is written.
+         * @return  Size written to 'plain', 0 if the MIC does not match or invalid size.
+         */
+        size_t _decrypt(const LoRaHeader_t* header, const uint8_t* content, size_t size, uint8_t* plain, uint32_t* counter);
+
+        /**
+         * @brief   Find the replay state of a radioId, adding it if new.
+         * @param   radioId Sender radioId, ignored if Terminal, which only receives from its Gateway.
+         * @return  Pointer to the replay state, NULL if new and \ref 'LORACOMM_CRYPTO_PEER_MAX' radioIds are already tracked.
+         * @note    Only called after the MIC is checked, so only controllers with the key take an element.
+         */
+        LoRaCryptoPeer_t* _cryptoPeer(uint32_t radioId);
+
+        /**
+         * @brief   Gateway: queue the TDMA beacon when its period ends. Terminal: go back to send at any time when beacons are lost.
+         */
+        void _tdmaProcess();
+
+        /**
+         * @brief   Terminal: use the slot of a received beacon.
+         * @param   content Content of the beacon, excluding header.
+         * @param   size Size of content.
+         */
+        void _tdmaOnBeacon(const uint8_t* content, size_t size);
+
+        /**
+         * @brief   Terminal: how long to wait for a payload to fit in the slot of this Terminal.
+         * @param   airtime Time on air of the payload in micros.
+         * @return  Time in millis to wait, 0 if can send now or not synced to a beacon.
+         */
+        uint32_t _tdmaGetWaitTime(uint32_t airtime);
+
+        /**
+         * @brief   Terminal: sleep or wake the LoRa device following the receive schedule.
+         */
+        void _rxScheduleProcess();
+
+        /**
+         * @brief   Gateway: how long to wait for a payload to fit in a receive window of a Terminal.
+         * @param   radioId Destination radioId.
+         * @param   airtime Time on air of the payload in micros.
+         * @return  Time in millis to wait, 0 if can send now, no receive schedule or nothing received yet from the radioId.
+         */
+        uint32_t _rxScheduleGetWaitTime(uint32_t radioId, uint32_t airtime);
+
+        /**
+         * @brief   Check if a payload requiring ACK was already received, and remember it if not.
+         * @param   radioId Source radioId.
+         * @param   seq Sequence number in the header, 0 if none.
+         * @param   checksum Checksum of the payload content.
+         * @param   window Time in millis to remember it, \ref 'LORACOMM_DEDUP_WINDOW' or \ref 'LORACOMM_RELAY_DEDUP_WINDOW'.
+         * @return  True if received within the window, meaning the sender did not get the ACK and retried, or a copy through a relay.
+         * @note    Payloads with the same seq and content from the same radioId within the window are considered the same payload.
+         *          Senders in older firmware have no seq, so for them it is only the same content.
+         */
+        bool _dedupCheck(uint32_t radioId, uint8_t seq, uint32_t checksum, uint32_t window);
+
+        /**
+         * @brief   Relay: check if payloads to and from a radioId are forwarded.
+         * @param   radioId Radio identifier.
+         * @return  True if in the list given to \ref 'setRelay', false otherwise.
+         */
+        bool _relayHasRoute(uint32_t radioId);
+
+        /**
+         * @brief   Relay: queue a received payload to be sent again as is, with one more hop.
+         * @param   header Header decoded.
+         * @param   format Header format received, the payload is forwarded in the same one.
+         * @param   content Content received, excluding header.
+         * @param   size Size of content.
+         */
+        void _relayForward(const LoRaHeader_t* header, ELoRaHeaderFormat format, const uint8_t* content, size_t size);
+
+        /**
+         * @brief   Hops learned from payloads received from a radioId.
+         * @param   radioId Radio identifier, ignored if Terminal, which only receives from its Gateway.
+         * @return  Hops of the last payload received through relays, 0 if none or only received directly.
+         */
+        uint8_t _relayHops(uint32_t radioId);
+
+        /**
+         * @brief   Carrier frequency to send to a radioId on.
+         * @param   radioId Destination, 'LORACOMM_RADIOID_BROADCAST' for the channel set with \ref 'setChannel'.
+         * @return  Frequency in Hz, of the channel of 'radioId' only if a Gateway with a channel plan and LoRa devices added with \ref 'addRadio'.
+         */
+        uint32_t _txFrequency(uint32_t radioId);
+
+        /**
+         * @brief   Statistics of a tagId, see \ref 'LORACOMM_STATS_TAG_COUNT'.
+         * @param   tagId The tagId.
+         * @return  Pointer to the statistics, shared by the tagIds without their own.
+         */
+        LoRaTagStatistics_t* _statsTagOf(uint8_t tagId);
+
+        /**
+         * @brief   Encode the header of a send queue element in its format, into 'headerEncoded'.
+         * @param   sendElement Pointer to LoRaSend_t, with 'header' and payload already set.
+         * @param   size Size of the payload, excluding header.
+         */
+        void _headerEncode(LoRaSend_t* sendElement, size_t size);
+
+        /**
+         * @brief   Decode and validate the header of a received payload, in any format.
+         * @param   payload Received payload, including header.
+         * @param   size Size of the received payload.
+         * @param   header Where to place the decoded header, its 'checksum' is calculated from the content for header v2.
+         * @param   format Where to place the format of the received header.
+         * @return  Size of the header, 0 if invalid, checksum mismatch, there is no content after the header or header v2 without CRC16 and
+         *          not allowed by \ref 'setHeaderUnchecked'.
+         */
+        size_t _headerDecode(const uint8_t* payload, size_t size, LoRaHeader_t* header, ELoRaHeaderFormat* format);
 
         /**
          * @brief   Updates the signal quality data structure with latest data.
          * @param   radioId RadioId of the controller that sent the payload.
+         * @param   size Size of the received payload, including header.
+         * @param   rssi Signal strenght.
+         * @param   snr Signal to noise ratio.
+         * @param   hops Hops of the received payload, if > 0 then 'rssi' and 'snr' are of the last relay and not used.
+         */
+        void _updateSignalQuality(uint32_t radioId, size_t size, int rssi, float snr, uint8_t hops);
+
+        /**
+         * @brief   Find the slot of a radioId in the signal quality data structure.
+         * @param   radioId Radio identifier.
+         * @param   insert If not found, return the empty or least recently updated slot in the probe window.
+         * @return  Pointer to the slot, NULL if not found and 'insert' is false.
+         */
+        LoRaSignalQuality_t* _findSignalQuality(uint32_t radioId, bool insert);
+
+        /**
+         * @brief   Receive, send and retry, everything \ref 'maintain' does besides calling user callbacks when there is a task.
+         */
+        void _process();
+
+        /**
+         * @brief   Task that runs \ref '_process' periodically.
+         * @param   arg Pointer to the LoRaComm.
+         */
+        static void _task(void* arg);
+
+        /**
+         * @brief   Deliver a payload to the user, directly or through the delivery queue when there is a task.
+         * @param   radioId RadioId found in the header.
+         * @param   tagId TagId of the payload.
+         * @param   payload Payload content, excluding header.
+         * @param   size Size of the payload content.
+         * @param   rssi Signal strenght.
+         * @param   snr Signal to noise ratio.
+         */
+        void _dispatch(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr);
+
+        /**
+         * @brief   Call the user callback registered for the tagId, or the catch-all one.
+         * @param   radioId RadioId found in the header.
+         * @param   tagId TagId of the payload.
+         * @param   payload Payload content, excluding header.
+         * @param   size Size of the payload content.
+         * @param   rssi Signal strenght.
+         * @param   snr Signal to noise ratio.
+         */
+        void _deliver(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, int rssi, float snr);
+
+        /**
+         * @brief   Start sending a payload above \ref 'LORACOMM_SEND_PAYLOAD_MAX' in fragments.
+         * @param   radioId Radio identifier.
+         * @param   tagId Identifies the type of the payload.
+         * @param   payload Payload to be sent.
+         * @param   size Size of the payload, up to \ref 'LORACOMM_MESSAGE_SIZE_MAX'.
+         * @param   priority Send queue priority of every fragment.
+         * @return  True if there was space in the fragment pool, false otherwise.
+         */
+        bool _fragmentSend(uint32_t radioId, uint8_t tagId, const uint8_t* payload, size_t size, ELoRaPriority priority);
+
+        /**
+         * @brief   Place pending fragments in the send queue, ask again for the received bitmap when timed out, and discard stale reassemblies.
+         */
+        void _fragmentProcess();
+
+        /**
+         * @brief   Handle a received fragment, reassemble it, ACK with the received bitmap and dispatch the payload when complete.
+         * @param   radioId RadioId found in the header.
+         * @param   content Fragment content, 'LoRaFragmentHeader_t' + data.
+         * @param   size Size of the content.
          * @param   rssi Signal strenght.
          * @param   snr Signal to noise ratio.
          */
-        void _updateSignalQuality(uint32_t radioId, int rssi, float snr);
+        void _fragmentOnReceive(uint32_t radioId, const uint8_t* content, size_t size, int rssi, float snr);
+
+        /**
+         * @brief   Handle a received bitmap of fragments, completing the send or scheduling the missing fragments.
+         * @param   radioId RadioId found in the header.
+         * @param   content Content, 'LoRaFragmentAck_t'.
+         * @param   size Size of the content.
+         */
+        void _fragmentOnAck(uint32_t radioId, const uint8_t* content, size_t size);
+
+        /**
+         * @brief   Append a payload to the aggregated packet of its radioId, starting a new one if none or it does not fit.
+         * @param   radioId Destination radioId.
+         * @param   tagId Identifies the type of the payload.
+         * @param   requireAck True if should be acknowledged, makes the whole aggregated packet require ACK.
+         * @param   payload Payload to be appended.
+         * @param   size Size of the payload, up to \ref 'LORACOMM_AGGREGATE_RECORD_MAX'.
+         * @return  True if appended, false if no space in the send queue or aggregation pool, or the aggregated packet airtime would be larger
+         *          than the duty cycle budget.
+         */
+        bool _aggregateAdd(uint32_t radioId, uint8_t tagId, bool requireAck, const uint8_t* payload, size_t size);
+
+        /**
+         * @brief   Queue for send the aggregated packet in use by an aggregation pool element, and release it.
+         * @param   aggregate Pointer to LoRaAggregate_t.
+         * @return  True if queued, false if its records were dropped, counted as 'dropped' of tagId \ref 'LORACOMM_TAGID_AGGREGATE'.
+         * @note    Its send queue element is reserved since the first record, and \ref '_aggregateAdd' only accepts records that fit
+         *          the duty cycle budget, so this only fails if encryption fails.
+         */
+        bool _aggregateCommit(LoRaAggregate_t* aggregate);
+
+        /**
+         * @brief   Queue for send the aggregated packets whose window ended.
+         */
+        void _aggregateProcess();
+
+        /**
+         * @brief   Unpack a received aggregated packet and deliver each record to its callback.
+         * @param   radioId Source radioId.
+         * @param   content Content of the aggregated packet, excluding header.
+         * @param   size Size of content.
+         * @param   rssi RSSI of the aggregated packet.
+         * @param   snr SNR of the aggregated packet.
+         */
+        void _aggregateOnReceive(uint32_t radioId, const uint8_t* content, size_t size, int rssi, float snr);
+
+        /**
+         * @brief   Gateway: choose the spreading factor and transmit power of a payload for a radioId, and assign it a new spreading factor if its signal quality changed.
+         * @param   radioId Destination radioId.
+         * @param   sf Spreading factor to use, set to the default when called, changed if the radioId was assigned another one.
+         * @param   power Transmit power to use, set to the default when called, lowered if there is margin.
+         */
+        void _adrSelect(uint32_t radioId, uint8_t* sf, uint8_t* power);
+
+        /**
+         * @brief   Terminal: change the spreading factor to receive on, keeping the default one to send.
+         * @param   sf Spreading factor assigned by the Gateway, 0 to go back to the default.
+         */
+        void _adrSetRxSpreadingFactor(uint8_t sf);
+
+        /**
+         * @brief   Reserve an element of the send queue and fill its header, so the payload can be written directly into it.
+         * @param   radioId Radio identifier.
+         * @param   tagId Identifies the type of the payload.
+         * @param   requireAck True if this payload should receive a ACK reply.
+         * @param   isAck True if this payload is an ACK, always \ref 'LORA_PRIORITY_ACK'.
+         * @param   priority Send queue priority, ignored if 'isAck'.
+         * @return  Pointer to LoRaSend_t, NULL if send queue is full, the last \ref 'LORACOMM_SEND_QUEUE_ACK_RESERVED' elements are only for ACKs.
+         * @note    Must be followed by \ref '_queueSendCommit', or the element released by clearing 'isReserved'.
+         */
+        LoRaSend_t* _queueSendReserve(uint32_t radioId, uint8_t tagId, bool requireAck, bool isAck, ELoRaPriority priority);
 
         /**
-         * @brief   Add to the send queue a payload to be sent.
-         * @param   requiresACK True if this payload should receive a ACK reply.
+         * @brief   Schedule a reserved element of the send queue to be sent, after its payload was written.
+         * @param   sendElement Pointer to LoRaSend_t returned by \ref '_queueSendReserve'.
          * @param   delay How long in millis to delay the send of this payload.
-         * @param   payloadSize Size in bytes of the entire payload, including header.
-         * @param   payload The entire payload, including header which can be accessed by casting this pointer to 'LoRaSend_t*'.
-         * @return  True if there was space and was added, false if queue is full of payload size above 'LORA_PACKET_MAX_SIZE'.
+         * @param   size Size in bytes of the payload, excluding header.
+         * @return  True if was scheduled, false if payload size above 'LORACOMM_SEND_PAYLOAD_MAX' or its airtime is larger than the duty cycle budget,
+         *          in which case the element is released.
          */
-        bool _queueSendAdd(bool requiresACK, uint64_t delay, size_t payloadSize, uint8_t* payload);
+        bool _queueSendCommit(LoRaSend_t* sendElement, uint64_t delay, size_t size);
+
+        /**
+         * @brief   Encode the header and schedule a reserved element of the send queue, with its content ready to be sent as is.
+         * @param   sendElement Pointer to LoRaSend_t returned by \ref '_queueSendReserve', with 'header.checksum' set.
+         * @param   delay How long in millis to delay the send of this payload.
+         * @param   size Size in bytes of the content, excluding header.
+         * @return  True if was scheduled, false if its airtime is larger than the duty cycle budget, in which case the element is released.
+         */
+        bool _queueSendEnqueue(LoRaSend_t* sendElement, uint64_t delay, size_t size);
+
+        /**
+         * @brief   Check if the send queue has a payload waiting to be sent.
+         * @param   radioId Radio identifier.
+         * @param   tagId TagId of the payload, before encryption and compression.
+         * @return  True if at least one is queued, false otherwise.
+         */
+        bool _queueSendHas(uint32_t radioId, uint8_t tagId);
+
+        /**
+         * @brief   Get the reserved element of the send queue that contains a payload pointer returned by \ref 'sendReserve'.
+         * @param   payload Payload pointer.
+         * @return  Pointer to LoRaSend_t, NULL if not a reserved element of the send queue.
+         */
+        LoRaSend_t* _queueSendFromPayload(uint8_t* payload);
 
         /**
          * @brief   Remove a payload from the send queue.
@@ -275,13 +1208,35 @@ class LoRaComm {
         void _queueSendRemove(LoRaSend_t* sendElement);
 
         /**
-         * @brief   Get the next payload ready to be sent, meaning that the appropriate time was reached.
+         * @brief   Get the next payload ready to be sent, meaning that the appropriate time was reached, highest priority first.
          * @return  Pointer to LoRaSend_t, NULL if send queue is empty.
          */
         LoRaSend_t* _queueSendGetReady();
 
+        /**
+         * @brief   Remove from the send queue the payload that an ACK was received for.
+         * @param   radioId RadioId found in the ACK header.
+         * @param   checksum Checksum of the acknowledged payload, found in the ACK content.
+         * @return  True if a matching payload was found and removed, false otherwise.
+         */
+        bool _queueSendAck(uint32_t radioId, uint32_t checksum);
+
+        /**
+         * @brief   Send the next ready payload in the send queue, and schedule its retry or remove it from the queue.
+         */
+        void _queueSendProcess();
+
 
         LoRaTxRx m_lora;            // Hardware used for lora commuincation.
+        LoRaTxRx* m_loraExtra[LORACOMM_RADIO_EXTRA_MAX] = {};  // Gateway: receive only LoRa devices, see \ref 'addRadio'.
+        uint8_t m_loraExtraCount = 0;
+        LoRaDutyCycle m_dutyCycle;  // Airtime budget, disabled unless \ref 'setDutyCycle' is called.
+
+        /** Adaptive data rate **/
+        bool m_adrEnabled = false;              // Gateway: choose spreading factor and transmit power per radioId.
+        uint8_t m_adrRxSpreadingFactor = 0;     // Terminal: spreading factor assigned by the Gateway to receive on, 0 if none.
+        uint8_t m_adrTxSpreadingFactor = 0;     // Terminal: default spreading factor, kept to send while receiving on the assigned one.
+        uint64_t m_adrLastReceivedAt = 0;       // Terminal: last time a payload directed to me was received, in millis.
         uint8_t m_cryptoPhrase;     // Value used to add to the checksum calculation, if '0' then it will not be used and normal checksum will be calculated.
         bool m_isTerminal;          // True when controller is a 'Terminal', false when is a 'Gateway'. Same analogy as a cellular network. 
         uint32_t m_terminalRadioId; // If isTerminal, then filter payloads only directed to my radioId.
@@ -292,10 +1247,12 @@ class LoRaComm {
          *          Only used in Gateway mode, this is so that 2 Gateways do not colide with each other when sending payloads.
          *          The one that received the weakest signal should wait longer, giving time to the stronger to send, and if the Terminal
          *          replies with ACK to that in time, both will mark as sent successfully (even thought that the weakest one never sent the payload).
+         *          Open addressing hash by 'radioId', a radioId is always within 'LORACOMM_SIGNAL_QUALITY_PROBE_MAX' slots of its hash.
          * @warning The logic that uses this data structure, intentionally does not support 'removing' elements (aka setting 'lastUpdateAt' = 0).
-         *          If that is done, duplicated elements can start appearing in this data structure.
+         *          If that is done, lookups stop at that empty slot and duplicated elements can start appearing in this data structure.
          */
         LoRaSignalQuality_t m_signalQuality[LORACOMM_SIGNAL_QUALITY_COUNT_MAX] = {};
+        static_assert((LORACOMM_SIGNAL_QUALITY_COUNT_MAX & (LORACOMM_SIGNAL_QUALITY_COUNT_MAX-1)) == 0, "LORACOMM_SIGNAL_QUALITY_COUNT_MAX must be a power of 2");
 
         /**
          * @brief   Queue that contains payloads to be sent.
@@ -303,23 +1260,106 @@ class LoRaComm {
          *          free for next usage.
          */
         LoRaSend_t m_sendQueue[LORACOMM_SEND_QUEUE_MAX] = {};   // Queue that contains the payloads to be sent.
+        uint32_t m_sendQueueMask[LORA_PRIORITY_COUNT] = {};     // Per priority, bit N set if 'm_sendQueue[N]' is queued for send.
+        static_assert(LORACOMM_SEND_QUEUE_MAX <= 32, "LORACOMM_SEND_QUEUE_MAX must fit in 'm_sendQueueMask'");
+
+        /** Duplicate suppression **/
+        LoRaDedup_t m_dedupCache[LORACOMM_DEDUP_CACHE_SIZE] = {};   // Payloads requiring ACK recently received.
+        uint8_t m_dedupNext = 0;                                    // Next element of 'm_dedupCache' to replace when none expired.
+        uint32_t m_statsPacketsDuplicated = 0;
+        uint8_t m_seq = 0;                                          // Sequence number of the last payload requiring ACK sent, skips 0.
+
+        ELoRaHeaderFormat m_headerFormat = LORA_HEADER_V1;  // Header format used to send.
+        bool m_headerUnchecked = false;                     // Receive 'LORA_HEADER_V2' payloads, which have no checksum.
+
+        /** Encryption **/
+        mbedtls_ccm_context m_ccm;      // Valid while 'm_cryptoEnabled'.
+        bool m_cryptoEnabled = false;
+        uint32_t m_cryptoCounter = 0;   // Counter of the last payload encrypted.
+        LoRaCryptoPeer_t m_cryptoRx = {};   // Terminal: replay state of the Gateway.
+
+        /**
+         * @brief   Gateway: replay state per radioId. Kept apart from 'm_signalQuality' because an evicted counter would go back to 0
+         *          and accept old payloads again. Open addressing hash by 'radioId', elements are only removed by \ref 'setEncryptionKey'.
+         */
+        LoRaCryptoPeer_t m_cryptoPeers[LORACOMM_CRYPTO_PEER_MAX] = {};
+        uint16_t m_cryptoPeerCount = 0;
+        static_assert((LORACOMM_CRYPTO_PEER_MAX & (LORACOMM_CRYPTO_PEER_MAX-1)) == 0, "LORACOMM_CRYPTO_PEER_MAX must be a power of 2");
+
+        /** Compression **/
+        bool m_compressEnabled = false;
+        const uint8_t* m_compressDictionary = NULL;
+        size_t m_compressDictionarySize = 0;
+        uint8_t m_compressDictionaryCheck = 0;  // Sent with each compressed payload, so a receiver with another dictionary drops it.
+
+        /** Relay **/
+        uint32_t m_relayRoutes[LORACOMM_RELAY_ROUTE_MAX] = {};  // Terminal: radioIds to forward payloads for.
+        uint8_t m_relayRouteCount = 0;  // Terminal: number of 'm_relayRoutes' in use, 0 if not a relay.
+        uint8_t m_relayRxHops = 0;      // Terminal: see 'LoRaSignalQuality_t::relayHops'.
+        uint64_t m_relayRxAt = 0;       // Terminal: see 'LoRaSignalQuality_t::relayedAt'.
+        uint32_t m_statsPacketsRelayed = 0;
+
+        bool m_lbtEnabled = false;  // Listen before talk, channel activity detection before each send.
+
+        /** Time division **/
+        LoRaBeacon_t m_tdmaBeacon = {};     // Gateway: beacon to send. Terminal: last beacon received.
+        uint64_t m_tdmaBeaconAt = 0;        // Gateway: next time to send the beacon. Terminal: when the last beacon was received, 0 if not synced.
+        uint16_t m_tdmaSlot = 0;            // Terminal: slot of this radioId in the last beacon received.
+
+        /** Receive schedule **/
+        uint32_t m_rxWindow = 0;        // Time in millis to listen after an uplink and on each wake, 0 if no schedule.
+        uint32_t m_rxWakePeriod = 0;    // Time in millis between wakes, 0 if only after an uplink.
+        uint64_t m_rxAnchorAt = 0;      // Terminal: last TxDone, start of the schedule.
+        bool m_rxSleeping = false;      // Terminal: LoRa device put to sleep by the schedule, not by 'disable'.
+
+        /** Channel plan **/
+        uint32_t m_channelFrequencies[LORACOMM_CHANNEL_COUNT_MAX] = {};    // Carrier frequencies in Hz.
+        uint8_t m_channelCount = 0;     // Number of channels in the plan, 0 if none and using the 'init' carrier frequency.
+        uint8_t m_channel = 0;          // Channel in use.
+        uint32_t m_initFrequency = 0;   // Carrier frequency in Hz given to 'init', used when there is no channel plan.
+
+        /** Aggregation **/
+        uint32_t m_aggregateWindow = 0;                                 // Time in millis to hold a payload for aggregation, 0 if disabled.
+        LoRaAggregate_t m_aggregate[LORACOMM_AGGREGATE_POOL_SIZE] = {}; // Aggregated packets being filled.
+
+        /** Fragmentation **/
+        uint8_t m_fragmentMessageId = 0;                                    // Next 'messageId' for a fragmented payload.
+        LoRaFragmentTx_t m_fragmentTx[LORACOMM_FRAGMENT_TX_POOL_SIZE] = {};  // Fragmented payloads being sent.
+        LoRaFragmentRx_t m_fragmentRx[LORACOMM_FRAGMENT_RX_POOL_SIZE] = {};  // Fragmented payloads being reassembled.
+
+        /** Statistics **/
+        LoRaTagStatistics_t m_statsTag[LORACOMM_STATS_TAG_COUNT+1+(LORACOMM_TAGID_COUNT-LORACOMM_TAGID_RESERVED_MIN)] = {};  // See '_statsTagOf'.
+        uint32_t m_statsPacketsInvalid = 0;
+        uint32_t m_statsPacketsFiltered = 0;
+        uint32_t m_statsAckLatency[LORACOMM_STATS_LATENCY_BUCKETS] = {};
+
+        /** Task **/
+        TaskHandle_t m_task = NULL;         // Task started with \ref 'startTask', NULL if none and everything runs in \ref 'maintain'.
+        SemaphoreHandle_t m_mutex = NULL;   // Serializes the task and the callers of the API, NULL if no task.
 
-        /** Queue with sents that require ACK **/
         /**
-         * TODO:
-         * - this queue should have the RSSI and SNR of the received payload that is going to reply with ACK
-         * - if is a Terminal, it should just ACK
-         * - if it is a Gateway, it should calculate how long it should wait until it sends a reply ACK
-         *      - stronger RSSI and stronger SNR should reply faster
-         *      - weaker RSSI and weaker SNR should reply slower
-         *      - I think that SNR should have higher bias because the payload was received clearer compared to a weaker SNR
-         *      - TIMEOUT should take this time into account, have a margin, and be aware of the payload air time
-         *      - It should listen to other Gateway ACK replies, and if is ACK for same Terminal, then drop it and mark is as ACKed
-         * - ACK is made based on both radioId and checksum
+         * @brief   Delivery queue, single producer (task) and single consumer (\ref 'maintain').
+         *          Head and tail are free running counters, the index is 'counter % LORACOMM_DELIVERY_QUEUE_SIZE'.
          */
+        LoRaDelivery_t m_delivery[LORACOMM_DELIVERY_QUEUE_SIZE];
+        std::atomic<uint32_t> m_deliveryHead{0};    // Next slot to be written by the task.
+        std::atomic<uint32_t> m_deliveryTail{0};    // Next slot to be read by \ref 'maintain'.
+        uint32_t m_statsPacketsUndelivered = 0;
 
         /** Callbacks **/
-        LoRaOnReceiveCallback_t m_onReceiveCallbacks[LORACOMM_ONRECEIVE_SIZE_MAX] = {};
+        /**
+         * @brief   Callbacks by tagId, 'm_onReceiveIndex' gives the slot of a tagId in O(1) without a 'std::function' per possible tagId.
+         *          Slots [0, 'm_onReceiveCount'[ are in use, removing one moves the last into its place.
+         */
+        uint8_t m_onReceiveIndex[LORACOMM_TAGID_COUNT] = {};    // Indexed by tagId, slot in 'm_onReceiveCallbacks' plus 1, 0 if not registered.
+        uint8_t m_onReceiveTagIds[LORACOMM_ONRECEIVE_SIZE_MAX] = {};    // TagId of each slot.
+        LoRaOnReceiveCallback m_onReceiveCallbacks[LORACOMM_ONRECEIVE_SIZE_MAX] = {};
+        uint8_t m_onReceiveCount = 0;
+        static_assert(LORACOMM_STATS_TAG_COUNT <= LORACOMM_TAGID_RESERVED_MIN, "LORACOMM_STATS_TAG_COUNT above the number of tagIds that can be registered");
+        static_assert((LORACOMM_DELIVERY_QUEUE_SIZE & (LORACOMM_DELIVERY_QUEUE_SIZE-1)) == 0, "LORACOMM_DELIVERY_QUEUE_SIZE must be a power of 2, positions wrap around");
+        static_assert(LORACOMM_MESSAGE_SIZE_MAX <= LORACOMM_FRAGMENT_COUNT_MAX*LORACOMM_FRAGMENT_DATA_MAX, "LORACOMM_MESSAGE_SIZE_MAX above what 'LORACOMM_FRAGMENT_COUNT_MAX' fragments carry");
+        static_assert(LORACOMM_ONRECEIVE_SIZE_MAX <= LORACOMM_TAGID_RESERVED_MIN, "LORACOMM_ONRECEIVE_SIZE_MAX above the number of tagIds that can be registered");
+        LoRaOnReceiveAnyCallback m_onReceiveAnyCallback = NULL;
 };
 
 #endif // _PINICORE_LORACOMM_H_
\ No newline at end of file
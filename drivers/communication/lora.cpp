@@ -1,22 +1,65 @@
 #include "lora.hpp"
 #include "utils/log.hpp"
 
-#include <LoRa.h>
-#include <SPI.h>
-
 #define PINICORE_TAG_LORA   "pcore_lora"
 
+/**
+ * @brief   SX127x registers and masks not exposed by the 'LoRa' library.
+ */
+#define LORA_REG_OP_MODE            0x01
+#define LORA_REG_IRQ_FLAGS          0x12
+#define LORA_REG_DIO_MAPPING_1      0x40
+#define LORA_IRQ_TX_DONE_MASK       0x08
+#define LORA_IRQ_RX_DONE_MASK       0x40
+#define LORA_IRQ_CRC_ERROR_MASK     0x20
+#define LORA_IRQ_CAD_DONE_MASK      0x04
+#define LORA_IRQ_CAD_DETECTED_MASK  0x01
+#define LORA_DIO0_TX_DONE           0x40    // DIO0 mapping: TxDone
+#define LORA_DIO0_CAD_DONE          0x80    // DIO0 mapping: CadDone
+#define LORA_MODE_CAD               0x87    // LoRa mode + channel activity detection
+#define LORA_SPI_SETTINGS           SPISettings(LORA_DEFAULT_SPI_FREQUENCY, MSBFIRST, SPI_MODE0)
+
+/**
+ * @brief   Automatically lock the LoRa device during the lifetime of the usage of this class.
+ * @note    Just declare a variable with with this class inside a block of code.
+ *          When that block of code ends, deconstruct will be called and the LoRa device unlocked.
+ */
+class AutoRadioLock {
+    public:
+        AutoRadioLock(SemaphoreHandle_t mutex) : m_mutex(mutex) { if (m_mutex != NULL) xSemaphoreTakeRecursive(m_mutex, portMAX_DELAY); }
+        ~AutoRadioLock() { if (m_mutex != NULL) xSemaphoreGiveRecursive(m_mutex); }
+    private:
+        SemaphoreHandle_t m_mutex;
+};
+
 bool LoRaTxRx::init(
     uint8_t pinMOSI, uint8_t pinMISO, uint8_t pinSCLK, uint8_t pinCS,
     uint8_t pinReset, uint8_t pinDIO0,
-    uint16_t carrierFrequency
+    uint16_t carrierFrequency,
+    SPIClass* spi
 ) {
-    SPI.begin(pinSCLK, pinMISO, pinMOSI, pinCS);
-    LoRa.setPins(pinCS, pinReset, pinDIO0);
-    if (!LoRa.begin(carrierFrequency*1E6)) {
+    m_pinCS     = pinCS;
+    m_pinDIO0   = pinDIO0;
+    m_frequency = carrierFrequency*1E6;
+    m_spi       = (spi != NULL) ? spi : &SPI;
+    m_spi->begin(pinSCLK, pinMISO, pinMOSI, pinCS);    // does nothing if the bus was already started by another LoRa device
+    m_radio.setSPI(*m_spi);
+    m_radio.setPins(pinCS, pinReset, pinDIO0);
+    if (!m_radio.begin(m_frequency)) {
         LOG_E(PINICORE_TAG_LORA, "Unable to initialize LoRa hardware, check if defined pins and module is installed correctly");
         return false;
     }
+    if (m_radioMutex == NULL) {
+        m_radioMutex = xSemaphoreCreateRecursiveMutex();
+    }
+    if (m_radioTask == NULL) {
+        if (xTaskCreatePinnedToCore(_radioTask, "pcore_lora", LORA_RADIO_TASK_STACK_SIZE, this, LORA_RADIO_TASK_PRIORITY, &m_radioTask, tskNO_AFFINITY) != pdPASS) {
+            LOG_E(PINICORE_TAG_LORA, "Unable to create LoRa radio task");
+            return false;
+        }
+    }
+    pinMode(m_pinDIO0, INPUT);
+    attachInterruptArg(digitalPinToInterrupt(m_pinDIO0), _onDio0Rise, this, RISING);
     enable();
     setSpreadingFactor(LORA_INIT_DEFAULT_SF);
     setTxPower(LORA_INIT_DEFAULT_POWER);
@@ -31,95 +74,343 @@ void LoRaTxRx::setSpreadingFactor(uint8_t sf) {
         sf = 12;
     }
     m_spreadingFactor = sf;
-    LoRa.setSpreadingFactor(sf);
+    AutoRadioLock lock(m_radioMutex);
+    m_radio.setSpreadingFactor(sf);
 }
 
 void LoRaTxRx::setTxPower(uint8_t power) {
     if (power > 20) {
         power = 20;
     }
-    //
-    int outputPin;
-    if (power < 15) {
-        outputPin = PA_OUTPUT_RFO_PIN;
-    }
-    else {
-        outputPin = PA_OUTPUT_PA_BOOST_PIN;
-    }
     m_txPower = power;
-    LoRa.setTxPower(power, outputPin);
+    AutoRadioLock lock(m_radioMutex);
+    _applyTxPower(power);
 }
 
 void LoRaTxRx::setBandwidth(ELoRaBandwidth bandwidth) {
     m_bandwidth = bandwidth;
-    LoRa.setSignalBandwidth((long)bandwidth);
+    AutoRadioLock lock(m_radioMutex);
+    m_radio.setSignalBandwidth((long)bandwidth);
+}
+
+bool LoRaTxRx::setFrequency(uint32_t frequency) {
+    AutoRadioLock lock(m_radioMutex);
+    if (isTransmitting()) return false;
+    m_frequency = frequency;
+    if (!isEnabled()) {
+        m_radio.setFrequency(frequency);
+        return true;
+    }
+    m_radio.idle();        // frequency registers are only written in standby
+    m_radio.setFrequency(frequency);
+    m_radio.receive();
+    return true;
+}
+
+void LoRaTxRx::setCrc(bool enable) {
+    m_crcEnabled = enable;
+    AutoRadioLock lock(m_radioMutex);
+    if (enable) {
+        m_radio.enableCrc();
+    }
+    else {
+        m_radio.disableCrc();
+    }
+}
+
+uint32_t LoRaTxRx::timeOnAir(size_t size, uint8_t spreadingFactor) {
+    const uint32_t sf = spreadingFactor;
+    const uint32_t bw = (uint32_t)m_bandwidth;
+    const uint32_t symbolTime = ((uint64_t)1000000 << sf) / bw;  // micros
+    const uint32_t symbolRate = bw >> sf;   // symbols per second, truncated as the 'LoRa' library does
+    const int32_t  lowDataRate = (symbolRate == 0 || (1000 / symbolRate) > LORA_LOW_DATA_RATE_SYMBOL_TIME) ? 1 : 0;
+    const int32_t  crc = m_crcEnabled ? 1 : 0;
+    const int32_t  implicitHeader = 0;  // always explicit header
+
+    // Tpreamble = (Npreamble + 4.25) * Tsym, kept in quarter symbols to avoid floating point
+    uint64_t quarterSymbols = (LORA_PREAMBLE_LENGTH * 4) + 17;
+
+    // Npayload = 8 + max(ceil((8*PL - 4*SF + 28 + 16*CRC - 20*IH) / (4*(SF - 2*DE))) * (CR + 4), 0)
+    int32_t numerator   = (8 * (int32_t)size) - (4 * (int32_t)sf) + 28 + (16 * crc) - (20 * implicitHeader);
+    int32_t denominator = 4 * ((int32_t)sf - (2 * lowDataRate));
+    int32_t blocks = (numerator > 0) ? ((numerator + denominator - 1) / denominator) : 0;
+    quarterSymbols += (8 + (blocks * LORA_CODING_RATE_DENOMINATOR)) * 4;
+
+    return (quarterSymbols * symbolTime) / 4;
 }
 
 void LoRaTxRx::maintain() {
     if (!isEnabled()) return;
 
-    if (!receive()) return; // check if new packet received, otherwise return
+    _checkTxDone();
 
-    LOG_T(PINICORE_TAG_LORA, "Processing received payload, %lu bytes", m_packetReceived.size);
-    _onReceive(m_packetReceived.payload, m_packetReceived.size, m_packetReceived.rssi, m_packetReceived.snr);
+    // Dispatch only what is already in the ring, packets arriving meanwhile wait for the next call
+    uint32_t head = m_rxHead.load(std::memory_order_acquire);
+    uint32_t tail = m_rxTail.load(std::memory_order_relaxed);
+    while (tail != head) {
+        LoRaReceived_t* packet = &m_rxRing[tail % LORA_RECEIVED_PACKET_MAX_COUNT];
+        LOG_T(PINICORE_TAG_LORA, "Processing received payload, %lu bytes", packet->size);
+        _onReceive(packet->payload, packet->size, packet->rssi, packet->snr);
+        ++tail;
+        m_rxTail.store(tail, std::memory_order_release);   // slot is free again only after the callback returns
+    }
 }
 
 void LoRaTxRx::enable() {
-    LoRa.idle();
+    AutoRadioLock lock(m_radioMutex);
+    m_radio.receive();     // continuous receive, DIO0 mapped to RxDone
     m_isActive = true;
 }
 
 void LoRaTxRx::disable() {
-    LoRa.sleep();
+    AutoRadioLock lock(m_radioMutex);
+    m_radio.sleep();
     m_isActive = false;
+    m_isTransmitting = false;   // sleep aborts any transmission on air
+    m_isCad = false;            // and any channel activity detection
+    _restoreTxSettings();       // so an aborted transmission does not leave its own spreading factor and transmit power
 }
 
-void LoRaTxRx::send(const uint8_t* payload, size_t size) {
-    size_t safeSize = (size>LORA_PACKET_MAX_SIZE) ? LORA_PACKET_MAX_SIZE : size;
-    LOG_T(PINICORE_TAG_LORA, "Preparing to send %lu bytes", safeSize);
-    LoRa.beginPacket();
-    LoRa.write(payload, safeSize);
-    LoRa.endPacket();
-    LoRa.receive();
-    LOG_T(PINICORE_TAG_LORA, "Sent %lu bytes", safeSize);
+bool LoRaTxRx::send(const uint8_t* payload, size_t size) {
+    return send(payload, size, m_spreadingFactor, m_txPower);
+}
 
-    /* Statistics */
-    m_statsBytesSent += safeSize;
-    ++m_statsPacketsSent;    
+bool LoRaTxRx::send(const uint8_t* payload, size_t size, uint8_t sf, uint8_t power) {
+    return send(payload, size, NULL, 0, sf, power);
+}
+
+bool LoRaTxRx::send(const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t size, uint8_t sf, uint8_t power) {
+    if (isTransmitting() || m_txDone || m_isCad) {
+        LOG_T(PINICORE_TAG_LORA, "Unable to send, still transmitting, TxDone not yet handled by 'maintain' or detecting channel activity");
+        return false;
+    }
+
+    sf    = (sf < 6) ? 6 : ((sf > 12) ? 12 : sf);
+    power = (power > 20) ? 20 : power;
+    headerSize = (headerSize>LORA_PACKET_MAX_SIZE) ? LORA_PACKET_MAX_SIZE : headerSize;
+    size = (size>LORA_PACKET_MAX_SIZE-headerSize) ? LORA_PACKET_MAX_SIZE-headerSize : size;
+    size_t safeSize = headerSize+size;
+    LOG_T(PINICORE_TAG_LORA, "Preparing to send %lu bytes [sf: %d] [power: %d]", safeSize, sf, power);
+    AutoRadioLock lock(m_radioMutex);
+    if (!m_radio.beginPacket()) {
+        LOG_T(PINICORE_TAG_LORA, "Unable to send, LoRa device busy");
+        return false;
+    }
+    m_radio.write(header, headerSize);     // written straight to the LoRa device FIFO, no intermediate buffer
+    if (size > 0) {
+        m_radio.write(payload, size);
+    }
+    m_txRestore = (sf != m_spreadingFactor) || (power != m_txPower);
+    if (sf != m_spreadingFactor) {
+        m_radio.setSpreadingFactor(sf);
+    }
+    if (power != m_txPower) {
+        _applyTxPower(power);
+    }
+    _writeRegister(LORA_REG_DIO_MAPPING_1, LORA_DIO0_TX_DONE);
+    m_isTransmitting = true;
+    m_txTimeoutAt    = getMillis() + (timeOnAir(safeSize, sf) / 1000) + LORA_TX_TIMEOUT_MARGIN;
+    m_txSize         = safeSize;
+    m_radio.endPacket(true);   // async, TxDone is handled by the radio task
+    LOG_T(PINICORE_TAG_LORA, "Sending %lu bytes", safeSize);
+    return true;
+}
+
+bool LoRaTxRx::startCad() {
+    AutoRadioLock lock(m_radioMutex);
+    if (!isEnabled() || isTransmitting() || m_isCad || m_cadDone) return false;
+
+    m_radio.idle();
+    _writeRegister(LORA_REG_IRQ_FLAGS, LORA_IRQ_CAD_DONE_MASK | LORA_IRQ_CAD_DETECTED_MASK);
+    _writeRegister(LORA_REG_DIO_MAPPING_1, LORA_DIO0_CAD_DONE);
+    m_isCad = true;
+    uint32_t symbolTime = ((uint64_t)1000000 << m_spreadingFactor) / (uint32_t)m_bandwidth;  // micros
+    m_cadTimeoutAt = getMillis() + ((symbolTime * LORA_CAD_SYMBOLS) / 1000) + LORA_CAD_TIMEOUT_MARGIN;
+    _writeRegister(LORA_REG_OP_MODE, LORA_MODE_CAD);
+    return true;
+}
+
+bool LoRaTxRx::getCadResult(bool* detected) {
+    if (m_isCad && getMillis() > m_cadTimeoutAt) {
+        AutoRadioLock lock(m_radioMutex);
+        if (m_isCad) {
+            m_isCad = false;
+            m_cadDetected = false;
+            m_cadDone = true;
+            m_radio.receive();
+            LOG_E(PINICORE_TAG_LORA, "Channel activity detection timed out without CadDone");
+        }
+    }
+    if (!m_cadDone) return false;
+    *detected = m_cadDetected;
+    m_cadDone = false;
+    return true;
 }
 
 void LoRaTxRx::onReceive(LoRaTxRxOnReceiveCallback callback) {
     m_onReceiveCallback = callback;
 }
 
+void LoRaTxRx::onTxDone(LoRaTxRxOnTxDoneCallback callback) {
+    m_onTxDoneCallback = callback;
+}
+
 
-bool LoRaTxRx::receive() {
-    size_t size = LoRa.parsePacket();
-    if (size <= 0) { return false; }
+void LoRaTxRx::receive() {
+    size_t size = m_radio.parsePacket();   // places LoRa device in idle, caller must go back to receive
+    if (size <= 0) { return; }
 
     /* Statistics */
     m_statsBytesReceived += size;
     ++m_statsPacketsReceived;
 
-    int rssi  = LoRa.packetRssi();
-    float snr = LoRa.packetSnr();
+    uint32_t head = m_rxHead.load(std::memory_order_relaxed);
+    uint32_t tail = m_rxTail.load(std::memory_order_acquire);
+    if (head - tail >= LORA_RECEIVED_PACKET_MAX_COUNT) {
+        ++m_statsPacketsDropped;
+        return;     // ring full, leave the packet in the FIFO, it will be overwritten by the next one
+    }
 
-    m_packetReceived.size = (size>LORA_PACKET_MAX_SIZE) ? LORA_PACKET_MAX_SIZE : size;
-    m_packetReceived.rssi = rssi;
-    m_packetReceived.snr  = snr;
+    LoRaReceived_t* packet = &m_rxRing[head % LORA_RECEIVED_PACKET_MAX_COUNT];
+    packet->size = (size>LORA_PACKET_MAX_SIZE) ? LORA_PACKET_MAX_SIZE : size;
+    packet->rssi = m_radio.packetRssi();
+    packet->snr  = m_radio.packetSnr();
 
-    for (size_t i=0; i<size && LoRa.available(); ++i) {
-        if (i < m_packetReceived.size) {
-            m_packetReceived.payload[i] = LoRa.read();
+    for (size_t i=0; i<size && m_radio.available(); ++i) {
+        if (i < packet->size) {
+            packet->payload[i] = m_radio.read();
         }
         else {
-            LoRa.read(); // discard the rest since it does not fit in packet buffer
+            m_radio.read(); // discard the rest since it does not fit in packet buffer
         }
     }
-    return true;
+    m_rxHead.store(head+1, std::memory_order_release);
 }
 
 void LoRaTxRx::_onReceive(const uint8_t* payload, size_t size, int rssi, float snr) {
     if (m_onReceiveCallback != NULL)
         m_onReceiveCallback(payload, size, rssi, snr);
 }
+
+void LoRaTxRx::_onTxDone() {
+    if (m_onTxDoneCallback != NULL)
+        m_onTxDoneCallback();
+}
+
+void LoRaTxRx::_checkTxDone() {
+    if (m_txDone) {
+        m_txDone = false;
+        LOG_T(PINICORE_TAG_LORA, "Sent %lu bytes", m_txSize);
+
+        /* Statistics */
+        m_statsBytesSent += m_txSize;
+        ++m_statsPacketsSent;
+
+        _onTxDone();
+        return;
+    }
+
+    if (isTransmitting() && getMillis() > m_txTimeoutAt) {
+        {
+            AutoRadioLock lock(m_radioMutex);
+            if (!isTransmitting()) return;  // radio task handled it meanwhile, will be reported on next call
+            m_isTransmitting = false;
+            _restoreReceive();
+        }
+        LOG_E(PINICORE_TAG_LORA, "Transmission of %lu bytes timed out without TxDone", m_txSize);
+        _onTxDone();    // not counted as sent, but whoever waits for the transmission to end must know it did
+    }
+}
+
+void LoRaTxRx::_handleDio0() {
+    AutoRadioLock lock(m_radioMutex);
+    if (!isEnabled()) return;
+
+    uint8_t irqFlags = _readRegister(LORA_REG_IRQ_FLAGS);
+    if (m_isCad) {
+        if ((irqFlags & LORA_IRQ_CAD_DONE_MASK) == 0) return;
+        _writeRegister(LORA_REG_IRQ_FLAGS, LORA_IRQ_CAD_DONE_MASK | LORA_IRQ_CAD_DETECTED_MASK);
+        m_cadDetected = (irqFlags & LORA_IRQ_CAD_DETECTED_MASK) != 0;
+        m_isCad = false;
+        m_cadDone = true;
+        m_radio.receive();     // also maps DIO0 back to RxDone
+        return;
+    }
+    if (isTransmitting()) {
+        if ((irqFlags & LORA_IRQ_TX_DONE_MASK) == 0) return;
+        _writeRegister(LORA_REG_IRQ_FLAGS, LORA_IRQ_TX_DONE_MASK);
+        m_isTransmitting = false;
+        m_txDone = true;
+        _restoreReceive();
+        return;
+    }
+
+    if ((irqFlags & LORA_IRQ_RX_DONE_MASK) == 0) return;
+    if ((irqFlags & LORA_IRQ_CRC_ERROR_MASK) != 0) {
+        _writeRegister(LORA_REG_IRQ_FLAGS, irqFlags);   // still in continuous receive, only clear
+        ++m_statsPacketsCrcError;
+        return;
+    }
+    receive();
+    m_radio.receive();
+}
+
+void LoRaTxRx::_applyTxPower(uint8_t power) {
+    int outputPin;
+    if (power < 15) {
+        outputPin = PA_OUTPUT_RFO_PIN;
+    }
+    else {
+        outputPin = PA_OUTPUT_PA_BOOST_PIN;
+    }
+    m_radio.setTxPower(power, outputPin);
+}
+
+void LoRaTxRx::_restoreTxSettings() {
+    if (m_txRestore) {
+        m_txRestore = false;
+        m_radio.setSpreadingFactor(m_spreadingFactor);
+        _applyTxPower(m_txPower);
+    }
+}
+
+void LoRaTxRx::_restoreReceive() {
+    _restoreTxSettings();
+    m_radio.receive();     // also maps DIO0 back to RxDone
+}
+
+void LoRaTxRx::_radioTask(void* arg) {
+    LoRaTxRx* lora = (LoRaTxRx*)arg;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LORA_RADIO_TASK_POLL));
+        lora->_handleDio0();
+    }
+}
+
+void IRAM_ATTR LoRaTxRx::_onDio0Rise(void* arg) {
+    LoRaTxRx* lora = (LoRaTxRx*)arg;
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(lora->m_radioTask, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+uint8_t LoRaTxRx::_readRegister(uint8_t address) {
+    m_spi->beginTransaction(LORA_SPI_SETTINGS);
+    digitalWrite(m_pinCS, LOW);
+    m_spi->transfer(address & 0x7f);
+    uint8_t value = m_spi->transfer(0x00);
+    digitalWrite(m_pinCS, HIGH);
+    m_spi->endTransaction();
+    return value;
+}
+
+void LoRaTxRx::_writeRegister(uint8_t address, uint8_t value) {
+    m_spi->beginTransaction(LORA_SPI_SETTINGS);
+    digitalWrite(m_pinCS, LOW);
+    m_spi->transfer(address | 0x80);
+    m_spi->transfer(value);
+    digitalWrite(m_pinCS, HIGH);
+    m_spi->endTransaction();
+}
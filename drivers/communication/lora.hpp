@@ -18,6 +18,12 @@
 
 #include <stdint.h>
 #include <functional>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <SPI.h>
+#include <LoRa.h>
 
 /**
  * Note: This table was taken from ChatGPT, take it with a grain of salt and just as a general idea.
@@ -58,6 +64,7 @@ enum class ELoRaBandwidth : long {
 
 // user callbacks
 typedef std::function<void(const uint8_t* payload, size_t size, int rssi, float snr)> LoRaTxRxOnReceiveCallback; // Callback for on receive a message
+typedef std::function<void(void)> LoRaTxRxOnTxDoneCallback; // Callback for when a message finished being transmitted
 
 #define LORA_INIT_DEFAULT_SF    7
 #define LORA_INIT_DEFAULT_POWER 20
@@ -65,6 +72,17 @@ typedef std::function<void(const uint8_t* payload, size_t size, int rssi, float
 
 #define LORA_PACKET_MAX_SIZE            255     // Taken from 'LoRa' -> 'MAX_PKT_LENGTH'
 #define LORA_RECEIVED_PACKET_MAX_COUNT  8       // Max number of packets received that can queue before start dropping.
+#define LORA_TX_TIMEOUT_MARGIN          1000    // Time in millis, after the expected time on air, after which a transmission without TxDone is considered lost.
+#define LORA_CAD_SYMBOLS                4       // Symbols a channel activity detection is expected to last, the SX127x takes about 2.
+#define LORA_CAD_TIMEOUT_MARGIN         100     // Time in millis, after the expected duration, after which a channel activity detection without CadDone is considered lost.
+
+#define LORA_PREAMBLE_LENGTH            8       // Preamble length in symbols, 'LoRa' library default.
+#define LORA_CODING_RATE_DENOMINATOR    5       // Coding rate 4/x, 'LoRa' library default.
+#define LORA_LOW_DATA_RATE_SYMBOL_TIME  16      // Symbol time in integer millis, 1000/(bandwidth/2^SF), above which low data rate optimize is enabled, same rule as 'LoRa' library 'setLdoFlag'. SF11 at 125kHz is 16, so off.
+
+#define LORA_RADIO_TASK_STACK_SIZE  4096    // Stack size in bytes of the task that services the DIO0 interrupt.
+#define LORA_RADIO_TASK_PRIORITY    10      // Priority of the task that services the DIO0 interrupt, above Arduino 'loop()' so received packets are drained right away.
+#define LORA_RADIO_TASK_POLL        100     // Time in millis the task waits for DIO0 before checking the LoRa device anyway, in case an interrupt was missed.
 
 typedef struct {
     size_t size;
@@ -84,15 +102,18 @@ class LoRaTxRx {
          * @param   pinReset Reset pin.
          * @param   pinDIO0 Digital IO 0 pin.
          * @param   carrierFrequency LoRa carrier frequency, see comment about 'usable radio frequencies' comment on the top of the LoRaTxRx class.
+         * @param   spi SPI bus of this LoRa device, NULL for the default 'SPI'. Several LoRa devices can share a bus, each with its own CS pin.
          * @return  True if hardware found and initialized, false otherwise.
          * @note	This function must be called prior to any other LoRaTxRx functions.
          *          Also calls \ref 'setSpreadingFactor', \ref 'setTxPower' and \ref 'setBandwidth' with default values, 'LORA_INIT_DEFAULT_x'.
          *          If different configuration is required, call their respective function. 
+         *          Each LoRaTxRx drives its own LoRa device, so several can be used at the same time, each with its own pins.
          */
         bool init(
             uint8_t pinMOSI, uint8_t pinMISO, uint8_t pinSCLK, uint8_t pinCS,
             uint8_t pinReset, uint8_t pinDIO0,
-            uint16_t carrierFrequency
+            uint16_t carrierFrequency,
+            SPIClass* spi = NULL
         );
 
         /**
@@ -119,6 +140,23 @@ class LoRaTxRx {
          */
         void setBandwidth(ELoRaBandwidth bandwidth);
 
+        /**
+         * @brief   Change the carrier frequency.
+         * @param   frequency Carrier frequency in Hz, see comment about 'usable radio frequencies' comment on the top of the LoRaTxRx class.
+         * @return  True if changed, false if transmitting, in which case try again after TxDone.
+         * @note    A packet being received while changing is lost.
+         */
+        bool setFrequency(uint32_t frequency);
+
+        /**
+         * @brief   Control the payload CRC calculated and checked by the LoRa device.
+         * @param   enable True to send every packet with CRC, false to send without it, which is the default.
+         * @note    Received packets with CRC are always checked, and dropped by the radio task before reading them from the LoRa device if it fails.
+         *          Packets without CRC are still received, so controllers with and without it can be in the same network.
+         *          Adds 2 bytes to the airtime of every packet.
+         */
+        void setCrc(bool enable);
+
         /**
          * @brief   Get current spreading factor.
          * @return  Spreading factor value range: [6,12].
@@ -138,33 +176,112 @@ class LoRaTxRx {
         inline const ELoRaBandwidth getBandwidth() { return m_bandwidth; }
 
         /**
-         * @brief   Keeps the LoRa communication alive, if new message calls on receive callback.
+         * @brief   Get payload CRC state.
+         * @return  True if packets are sent with CRC, false otherwise.
+         */
+        inline const bool isCrcEnabled() { return m_crcEnabled; }
+
+        /**
+         * @brief   Get current carrier frequency.
+         * @return  Carrier frequency in Hz.
+         */
+        inline const uint32_t getFrequency() { return m_frequency; }
+
+        /**
+         * @brief   Calculate how long a payload occupies the channel, using the Semtech SX127x datasheet formula.
+         * @param   size Size of the payload in bytes.
+         * @param   spreadingFactor Spreading factor the payload is sent with.
+         * @return  Time on air in micros, for the current bandwidth.
+         */
+        uint32_t timeOnAir(size_t size, uint8_t spreadingFactor);
+
+        /**
+         * @brief   Calculate how long a payload occupies the channel, using the Semtech SX127x datasheet formula.
+         * @param   size Size of the payload in bytes.
+         * @return  Time on air in micros, for the current spreading factor and bandwidth.
+         */
+        inline uint32_t timeOnAir(size_t size) { return timeOnAir(size, m_spreadingFactor); }
+
+        /**
+         * @brief   Keeps the LoRa communication alive, calls on receive callback for all the packets received since last call.
+         *          Also checks if the current transmission is done, and if so calls on TxDone callback.
          * @note    Call this function periodically to parse new received messages.
+         *          Packets are drained from the LoRa device by a high priority task as soon as DIO0 RxDone rises, and kept in a ring
+         *          of \ref 'LORA_RECEIVED_PACKET_MAX_COUNT' packets until this function is called. If the ring is full, new packets are dropped.
          */
         void maintain();
 
         /**
-         * @brief   Idle/Standby the LoRa device.
+         * @brief   Wake the LoRa device and place it in continuous receive.
          */
         void enable();
 
         /**
          * @brief   Sleep the LoRa device.
+         * @note    Aborts a transmission on air, without TxDone, and restores the spreading factor and transmit power changed for it.
          */
         void disable();
 
         /**
          * @brief   Get LoRa device state.
-         * @return  True if on idle/standby, false if on sleep.
+         * @return  True if on receive/transmit, false if on sleep.
          */
         inline const bool isEnabled() { return m_isActive; }
 
         /**
-         * @brief   Send a payload over LoRa.
+         * @brief   Get LoRa device transmit state.
+         * @return  True if a transmission started by \ref 'send' is still on air, false otherwise.
+         */
+        inline const bool isTransmitting() { return m_isTransmitting; }
+
+        /**
+         * @brief   Start a channel activity detection, the LoRa device listens for a preamble on the current spreading factor for about 2 symbols.
+         * @return  True if started, false if transmitting, a detection is running or its result was not yet read with \ref 'getCadResult'.
+         * @note    Returns right away, the result is handled by the radio task. Packets are not received while detecting.
+         */
+        bool startCad();
+
+        /**
+         * @brief   Get the result of the channel activity detection started by \ref 'startCad', only returned once.
+         * @param   detected Where to place the result, true if the channel is busy, false if free.
+         * @return  True if there was a result, false if none was started or still running.
+         * @note    A detection without CadDone for too long is considered lost and returns the channel as free.
+         */
+        bool getCadResult(bool* detected);
+
+        /**
+         * @brief   Start sending a payload over LoRa.
+         * @param   payload The payload to be sent.
+         * @param   size Size of the payload, max is \ref 'LORA_PACKET_MAX_SIZE' and if above then rest is dropped and not send.
+         * @return  True if transmission started, false if still transmitting a previous payload or its TxDone was not yet handled by \ref 'maintain'.
+         * @note    Returns as soon as the payload is in the LoRa device, does not wait for it to be on air.
+         *          When the transmission ends, the LoRa device goes back to receive and \ref 'maintain' calls on TxDone callback.
+         */
+        bool send(const uint8_t* payload, size_t size);
+
+        /**
+         * @brief   Start sending a payload over LoRa with a spreading factor and transmit power for this payload only.
          * @param   payload The payload to be sent.
-         * @param   size Size of the payload, max is \ref 'LORA_RECEIVED_PACKET_MAX_SIZE' and if above then rest is dropped and not send.
+         * @param   size Size of the payload, max is \ref 'LORA_PACKET_MAX_SIZE' and if above then rest is dropped and not send.
+         * @param   sf Spreading factor for this payload, range: [6,12].
+         * @param   power Transmit power in dBm for this payload, range: [0, 20].
+         * @return  True if transmission started, false if still transmitting a previous payload or its TxDone was not yet handled by \ref 'maintain'.
+         * @note    When the transmission ends, the LoRa device goes back to the spreading factor and transmit power set with
+         *          \ref 'setSpreadingFactor' and \ref 'setTxPower' before going back to receive.
+         */
+        bool send(const uint8_t* payload, size_t size, uint8_t sf, uint8_t power);
+
+        /**
+         * @brief   Start sending a payload made of two parts, written one after the other to the LoRa device, so they do not have to be joined first.
+         * @param   header First part of the payload.
+         * @param   headerSize Size of the first part.
+         * @param   payload Second part of the payload, can be NULL if 'size' is 0.
+         * @param   size Size of the second part, if the total is above \ref 'LORA_PACKET_MAX_SIZE' then rest is dropped and not send.
+         * @param   sf Spreading factor for this payload, range: [6,12].
+         * @param   power Transmit power in dBm for this payload, range: [0, 20].
+         * @return  True if transmission started, false if still transmitting a previous payload or its TxDone was not yet handled by \ref 'maintain'.
          */
-        void send(const uint8_t* payload, size_t size);
+        bool send(const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t size, uint8_t sf, uint8_t power);
         
         /**
          * @brief   Registers a callback function to be called when a message is received client.
@@ -172,6 +289,13 @@ class LoRaTxRx {
          */
         void onReceive(LoRaTxRxOnReceiveCallback callback);
 
+        /**
+         * @brief   Registers a callback function to be called when a transmission started by \ref 'send' is done.
+         * @param   callback The callback function with the signature void(void) to be registered.
+         * @note    Also called when the transmission times out without TxDone, see \ref 'LORA_TX_TIMEOUT_MARGIN'.
+         */
+        void onTxDone(LoRaTxRxOnTxDoneCallback callback);
+
         /**
          * @brief   Statistics: number of bytes sent.
          * @return  Number of bytes sent.
@@ -196,13 +320,25 @@ class LoRaTxRx {
          */
         inline uint32_t statsPacketsReceived() { return m_statsPacketsReceived; }
 
+        /**
+         * @brief   Statistics: number of packets received but dropped because the receive ring was full.
+         * @return  Number of packets dropped.
+         */
+        inline uint32_t statsPacketsDropped() { return m_statsPacketsDropped; }
+
+        /**
+         * @brief   Statistics: number of packets received but dropped because their payload CRC failed.
+         * @return  Number of packets with CRC error.
+         */
+        inline uint32_t statsPacketsCrcError() { return m_statsPacketsCrcError; }
+
 
     private:
         /**
-         * @brief   Check if new packet received and place it in \ref 'm_packetReceived'.
-         * @return  True if packet ready to be processed, false otherwise.
+         * @brief   Read the received packet from the LoRa device and place it in the receive ring.
+         * @note    Called from the radio task with the radio locked.
          */
-        bool receive();
+        void receive();
 
         /**
          * @brief   Safely call 'onReceive' callback.
@@ -213,24 +349,115 @@ class LoRaTxRx {
          */
         void _onReceive(const uint8_t* payload, size_t size, int rssi, float snr);
 
+        /**
+         * @brief   Safely call 'onTxDone' callback.
+         */
+        void _onTxDone();
+
+        /**
+         * @brief   Check if the current transmission is done or timed out, if so call 'onTxDone' callback.
+         */
+        void _checkTxDone();
+
+        /**
+         * @brief   Handle the LoRa device interrupt flags, TxDone and RxDone.
+         * @note    Called from the radio task.
+         */
+        void _handleDio0();
+
+        /**
+         * @brief   Set the transmit power in the LoRa device, choosing the output pin for it.
+         * @param   power Power in dBm, range: [0, 20].
+         */
+        void _applyTxPower(uint8_t power);
+
+        /**
+         * @brief   Restore the spreading factor and transmit power if changed for the last payload.
+         * @note    Must be called with the radio locked.
+         */
+        void _restoreTxSettings();
+
+        /**
+         * @brief   Restore the spreading factor and transmit power if changed for the last payload, and go back to receive.
+         * @note    Must be called with the radio locked.
+         */
+        void _restoreReceive();
+
+        /**
+         * @brief   Task that waits for DIO0 and drains the LoRa device.
+         * @param   arg Pointer to the LoRaTxRx that owns the task.
+         */
+        static void _radioTask(void* arg);
+
+        /**
+         * @brief   Interrupt handler for the DIO0 pin, only wakes the radio task.
+         * @param   arg Pointer to the LoRaTxRx that owns the pin.
+         */
+        static void _onDio0Rise(void* arg);
+
+        /**
+         * @brief   Read a register directly from the LoRa device, for the features that 'LoRa' library does not expose.
+         * @param   address Register address.
+         * @return  Register value.
+         */
+        uint8_t _readRegister(uint8_t address);
+
+        /**
+         * @brief   Write a register directly to the LoRa device, for the features that 'LoRa' library does not expose.
+         * @param   address Register address.
+         * @param   value Value to write.
+         */
+        void _writeRegister(uint8_t address, uint8_t value);
+
         
+        LoRaClass m_radio;          // LoRa device of this instance, not the 'LoRa' global.
+        SPIClass* m_spi = NULL;     // SPI bus of the LoRa device, not owned.
+        uint8_t m_pinCS;
+        uint8_t m_pinDIO0;
+        uint32_t m_frequency;
         uint8_t m_spreadingFactor;
         uint8_t m_txPower;
         ELoRaBandwidth m_bandwidth;
+        bool m_crcEnabled = false;
 
-        bool m_isActive = false;    // True if on idle/standby, false is on sleep.
+        bool m_isActive = false;    // True if on receive/transmit, false is on sleep.
 
-        /** Receive payload handling variables **/
-        LoRaReceived_t m_packetReceived;  // Packet received.
+        /** Radio task variables **/
+        TaskHandle_t m_radioTask = NULL;        // Task that services DIO0.
+        SemaphoreHandle_t m_radioMutex = NULL;  // Serializes access to the LoRa device between the radio task and the caller of the API.
+
+        /** Transmit handling variables **/
+        volatile bool m_isTransmitting = false; // True while a payload is on air.
+        volatile bool m_txDone  = false;        // Set by the radio task when TxDone, cleared by \ref 'maintain'.
+        uint64_t m_txTimeoutAt  = 0;            // When the current transmission is considered lost if no TxDone, in millis.
+        size_t m_txSize         = 0;            // Size of the current transmission.
+        bool m_txRestore        = false;        // True if the current transmission changed spreading factor or transmit power.
+
+        /** Channel activity detection variables **/
+        volatile bool m_isCad       = false;    // True while a channel activity detection is running.
+        volatile bool m_cadDone     = false;    // Set by the radio task when CadDone, cleared by \ref 'getCadResult'.
+        volatile bool m_cadDetected = false;    // Result of the last channel activity detection.
+        uint64_t m_cadTimeoutAt     = 0;        // When the current detection is considered lost if no CadDone, in millis.
+
+        /**
+         * @brief   Receive ring, single producer (radio task) and single consumer (\ref 'maintain').
+         *          Head and tail are free running counters, the index is 'counter % LORA_RECEIVED_PACKET_MAX_COUNT'.
+         */
+        LoRaReceived_t m_rxRing[LORA_RECEIVED_PACKET_MAX_COUNT];
+        std::atomic<uint32_t> m_rxHead{0};  // Next slot to be written by the radio task.
+        std::atomic<uint32_t> m_rxTail{0};  // Next slot to be read by \ref 'maintain'.
 
         /** Callbacks **/
         LoRaTxRxOnReceiveCallback m_onReceiveCallback = NULL;
+        LoRaTxRxOnTxDoneCallback  m_onTxDoneCallback  = NULL;
 
         /** Statistics **/
         uint32_t m_statsBytesSent       = 0;
         uint32_t m_statsBytesReceived   = 0;
         uint32_t m_statsPacketsSent     = 0;
         uint32_t m_statsPacketsReceived = 0;
+        uint32_t m_statsPacketsDropped  = 0;
+        uint32_t m_statsPacketsCrcError = 0;
 };
 
 #endif // _PINICORE_STORAGE_H_
\ No newline at end of file
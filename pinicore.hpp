@@ -66,6 +66,7 @@
 
 #include "communication/network/request/mqtt/mqtt.hpp"
 
+#include "communication/radio/dutycycle.hpp"
 #include "communication/radio/loracomm.hpp"
 
 #endif /* _PINICORE_H_ */
@@ -0,0 +1,117 @@
+#include "compress.hpp"
+
+/**
+ * @brief   Byte at a position of the dictionary followed by the data.
+ * @param   dictionary Dictionary.
+ * @param   dictionarySize Size of the dictionary.
+ * @param   data Data after the dictionary.
+ * @param   position Position, the data starts at 'dictionarySize'.
+ * @return  Byte at 'position'.
+ */
+static inline uint8_t windowAt(const uint8_t* dictionary, size_t dictionarySize, const uint8_t* data, size_t position) {
+    return (position < dictionarySize) ? dictionary[position] : data[position-dictionarySize];
+}
+
+/**
+ * @brief   Write the pending literal run.
+ * @return  Position in 'out' after the run, 0 if it does not fit.
+ */
+static size_t flushLiterals(const uint8_t* literals, size_t count, uint8_t* out, size_t outPos, size_t outMax) {
+    if (count == 0) return outPos;
+    if (outPos + 1 + count > outMax) return 0;
+    out[outPos++] = count - 1;
+    for (size_t i=0; i<count; ++i) {
+        out[outPos++] = literals[i];
+    }
+    return outPos;
+}
+
+size_t compressLz(const uint8_t* data, size_t size, uint8_t* out, size_t outMax, const uint8_t* dictionary, size_t dictionarySize) {
+    if (dictionary == NULL) dictionarySize = 0;
+    if (dictionarySize > COMPRESS_WINDOW_MAX) {
+        dictionary += dictionarySize - COMPRESS_WINDOW_MAX;
+        dictionarySize = COMPRESS_WINDOW_MAX;
+    }
+
+    size_t outPos = 0;
+    size_t literalStart = 0;
+    size_t literalCount = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        // Longest match in the window, nearest first so equal lengths use the smallest offset
+        size_t current = dictionarySize + pos;
+        size_t windowStart = (current > COMPRESS_WINDOW_MAX) ? current - COMPRESS_WINDOW_MAX : 0;
+        size_t bestLength = 0;
+        size_t bestOffset = 0;
+        for (size_t candidate=current; candidate-- > windowStart; ) {
+            size_t length = 0;
+            while (length < COMPRESS_MATCH_MAX && pos+length < size &&
+                   windowAt(dictionary, dictionarySize, data, candidate+length) == data[pos+length]) {
+                ++length;
+            }
+            if (length > bestLength) {
+                bestLength = length;
+                bestOffset = current - candidate;
+                if (length == COMPRESS_MATCH_MAX) break;
+            }
+        }
+
+        if (bestLength < COMPRESS_MATCH_MIN) {
+            if (literalCount == 0) literalStart = pos;
+            ++literalCount;
+            ++pos;
+            if (literalCount == COMPRESS_LITERAL_MAX) {
+                outPos = flushLiterals(data+literalStart, literalCount, out, outPos, outMax);
+                if (outPos == 0) return 0;
+                literalCount = 0;
+            }
+            continue;
+        }
+
+        outPos = flushLiterals(data+literalStart, literalCount, out, outPos, outMax);
+        if (outPos == 0 && literalCount != 0) return 0;
+        literalCount = 0;
+        if (outPos + 2 > outMax) return 0;
+        uint16_t offset = bestOffset - 1;
+        out[outPos++] = 0x80 | ((bestLength - COMPRESS_MATCH_MIN) << 3) | (offset >> 8);
+        out[outPos++] = offset & 0xFF;
+        pos += bestLength;
+    }
+    outPos = flushLiterals(data+literalStart, literalCount, out, outPos, outMax);
+    if (outPos == 0 && literalCount != 0) return 0;
+    return outPos;
+}
+
+size_t decompressLz(const uint8_t* data, size_t size, uint8_t* out, size_t outMax, const uint8_t* dictionary, size_t dictionarySize) {
+    if (dictionary == NULL) dictionarySize = 0;
+    if (dictionarySize > COMPRESS_WINDOW_MAX) {
+        dictionary += dictionarySize - COMPRESS_WINDOW_MAX;
+        dictionarySize = COMPRESS_WINDOW_MAX;
+    }
+
+    size_t outPos = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        uint8_t token = data[pos++];
+        if ((token & 0x80) == 0) {
+            size_t count = token + 1;
+            if (pos + count > size || outPos + count > outMax) return 0;
+            for (size_t i=0; i<count; ++i) {
+                out[outPos++] = data[pos++];
+            }
+            continue;
+        }
+
+        if (pos >= size) return 0;
+        size_t length = ((token >> 3) & 0x0F) + COMPRESS_MATCH_MIN;
+        size_t offset = (((token & 0x07) << 8) | data[pos++]) + 1;
+        size_t current = dictionarySize + outPos;
+        if (offset > current || outPos + length > outMax) return 0;
+        for (size_t i=0; i<length; ++i) {
+            // Byte by byte, a match can overlap the bytes it writes
+            out[outPos] = windowAt(dictionary, dictionarySize, out, current - offset + i);
+            ++outPos;
+        }
+    }
+    return outPos;
+}
@@ -0,0 +1,59 @@
+/**
+* @file		compress.hpp
+* @brief	Compression with a static dictionary, for small payloads.
+* @author	PiniponSelvagem
+*
+* Copyright(C) PiniponSelvagem
+*
+***********************************************************************
+* Software that is described here, is for illustrative purposes only
+* which provides customers with programming information regarding the
+* products. This software is supplied "AS IS" without any warranties.
+**********************************************************************/
+
+#pragma once
+
+#ifndef _PINICORE_COMPRESS_H_
+#define _PINICORE_COMPRESS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * LZ77 byte stream, matches can point into a dictionary known by both parties, so even a small payload compresses.
+ * Offsets count back from the current position in the dictionary followed by the data already decompressed.
+ * 0lllllll                     -> literal run, (l+1) bytes follow
+ * 1llllooo oooooooo            -> match of (l+COMPRESS_MATCH_MIN) bytes at offset (o+1)
+ */
+#define COMPRESS_MATCH_MIN      3       // Shortest match encoded, a match takes 2 bytes.
+#define COMPRESS_MATCH_MAX      (COMPRESS_MATCH_MIN+0x0F)   // Longest match encoded.
+#define COMPRESS_LITERAL_MAX    0x80    // Longest literal run encoded.
+#define COMPRESS_WINDOW_MAX     0x800   // Farthest offset, the dictionary and data already compressed beyond it are not used.
+
+
+/**
+ * @brief   Compress data with a static dictionary.
+ * @param   data The data to compress.
+ * @param   size Size of the data.
+ * @param   out Where to write the compressed data.
+ * @param   outMax Size of 'out'.
+ * @param   dictionary Bytes likely to appear in the data, most common last since they are closer, NULL if none.
+ * @param   dictionarySize Size of the dictionary, only the last \ref 'COMPRESS_WINDOW_MAX' bytes are used.
+ * @return  Size of the compressed data, 0 if it does not fit in 'outMax'.
+ * @note    No heap, searches every position of the window, meant for payloads of a few hundred bytes.
+ */
+size_t compressLz(const uint8_t* data, size_t size, uint8_t* out, size_t outMax, const uint8_t* dictionary, size_t dictionarySize);
+
+/**
+ * @brief   Decompress data compressed with \ref 'compressLz'.
+ * @param   data The compressed data.
+ * @param   size Size of the compressed data.
+ * @param   out Where to write the decompressed data.
+ * @param   outMax Size of 'out'.
+ * @param   dictionary Same dictionary used to compress.
+ * @param   dictionarySize Size of the dictionary.
+ * @return  Size of the decompressed data, 0 if invalid or does not fit in 'outMax'.
+ */
+size_t decompressLz(const uint8_t* data, size_t size, uint8_t* out, size_t outMax, const uint8_t* dictionary, size_t dictionarySize);
+
+#endif // _PINICORE_COMPRESS_H_
@@ -1,11 +1,42 @@
-#include "crypto.h"
+#include "crypto.hpp"
+
+#ifdef ESP32
+#include <rom/crc.h>
+#else
 #include <CRC32.h>
+#endif
 
 
 uint32_t calculateChecksum(const uint8_t* data, size_t size, const uint8_t phrase) {
+#ifdef ESP32
+    // ROM table driven CRC32, same result as the 'CRC32' library, inverts on entry and exit so it can be chained
+    uint32_t crc = 0;
+    if (phrase != 0)
+        crc = crc32_le(crc, &phrase, 1);
+    return crc32_le(crc, data, size);
+#else
     CRC32 crc;
     if (phrase != 0)
         crc.add(phrase);
     crc.add(data, size);
     return crc.calc();
+#endif
+}
+
+static uint16_t crc16Add(uint16_t crc, uint8_t data) {
+    crc ^= (uint16_t)data << 8;
+    for (uint8_t i=0; i<8; ++i) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+    return crc;
+}
+
+uint16_t calculateChecksum16(const uint8_t* data, size_t size, const uint8_t phrase) {
+    uint16_t crc = 0xFFFF;
+    if (phrase != 0)
+        crc = crc16Add(crc, phrase);
+    for (size_t i=0; i<size; ++i) {
+        crc = crc16Add(crc, data[i]);
+    }
+    return crc;
 }
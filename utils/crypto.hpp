@@ -28,4 +28,12 @@
  */
 uint32_t calculateChecksum(const uint8_t* data, size_t size, const uint8_t phrase = 0);
 
+/**
+ * @brief   Calculate the 16 bit checksum of a payload, CRC-16/CCITT-FALSE.
+ * @param   data The data to calculate the checksum.
+ * @param   size Size of the data.
+ * @param   phrase A value known by both parties to further improve data validation, if '0' then phrase is not added to checksum calculation.
+ */
+uint16_t calculateChecksum16(const uint8_t* data, size_t size, const uint8_t phrase = 0);
+
 #endif // _PINICORE_CRYPTO_H_
\ No newline at end of file